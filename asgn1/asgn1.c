@@ -9,8 +9,13 @@
  * limited by the amount of memory available and serves as the requirement for
  * COSC440 assignment 1 in 2012.
  *
- * Note: multiple devices and concurrent modules are not supported in this
- *       version.
+ * Each minor is an independent ramdisk with its own pages and counters,
+ * the number of them is set with the devices module parameter. With
+ * disk_size set, each ramdisk is also a blk-mq block device. With compress
+ * set, pages which go unused for a while are kept compressed. With dedup
+ * set, they are merged with identical pages instead. With backing_file set,
+ * the contents are saved on rmmod and restored in the background on insmod.
+ * With kv set, each ramdisk is a key-value store instead, see kv_put.
  */
 
 /* This program is free software; you can redistribute it and/or
@@ -27,12 +32,47 @@
 #include <asm/uaccess.h>
 #include <linux/slab.h>
 #include <linux/mm.h>
-#include <linux/proc_fs.h>
 #include <linux/device.h>
+#include <linux/xarray.h>
+#include <linux/pagemap.h>
+#include <linux/falloc.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/uaccess.h>
+#include <linux/rcupdate.h>
+#include <linux/huge_mm.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/percpu_counter.h>
+#include <linux/hashtable.h>
+#include <linux/xxhash.h>
+#include <linux/file.h>
+#include <linux/bvec.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/mutex.h>
+#include <linux/nodemask.h>
+#include <linux/gfp.h>
+#include <linux/anon_inodes.h>
+#include <linux/crc32.h>
+#include <linux/memcontrol.h>
+#include <crypto/acompress.h>
+#include "asgn1_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "asgn1_trace.h"
 
 #define MYDEV_NAME "asgn1"
-#define MYIOC_TYPE 'k'
-#define MYPROC_NAME "asgn1"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Andy Hansen");
@@ -40,461 +80,4851 @@ MODULE_DESCRIPTION("COSC440 asgn1");
 
 
 /**
- * The node structure for the memory page linked list.
+ * A page of a ramdisk shared by every page node whose contents are the same.
+ * Shared pages are never written, a writer gets a copy of its own first.
+ */
+typedef struct shared_page_rec {
+  struct hlist_node hash;   /* in the dedup hash table of the device */
+  u64 hash_val;             /* hash of the contents */
+  struct page *page;
+  unsigned int sharers;     /* page nodes holding the page */
+} shared_page;
+
+/**
+ * The node structure for a memory page held by the ramdisk. Nodes are kept
+ * in the device's page index, keyed by page number. A node may hold an
+ * extent of 2^order pages, in which case it is stored at every page number
+ * of the extent. Readers look nodes up under RCU only, so a node is freed a
+ * grace period after it leaves the index.
  */ 
 typedef struct page_node_rec {
-  struct list_head list;
-  struct page *page;
+  struct page *page;    /* first page of the extent, NULL if compressed */
+  unsigned long index;  /* page number of the first page */
+  unsigned int order;   /* the extent holds 2^order pages */
+  bool referenced;      /* used since the last cold page scan */
+  void *zdata;          /* compressed contents of a single page */
+  unsigned int zlen;    /* size of zdata */
+  shared_page *shared;  /* the page is shared with identical ones, if set */
+  unsigned long flags;  /* NODE_* bits */
+  unsigned long gen;    /* generation of the device it was written in */
+  struct rcu_head rcu;
 } page_node;
 
+#define NODE_RESERVED 0       /* preallocated and not written to yet */
+
+/**
+ * A range of pages locked by a reader or writer of a device. Readers only
+ * wait for writers on overlapping pages, writers for anyone overlapping.
+ */
+typedef struct page_range_rec {
+  struct list_head list;
+  unsigned long first;  /* first page number in the range */
+  unsigned long last;   /* last page number in the range */
+  bool write;
+} page_range;
+
+#define LAT_BUCKETS 32          /* latency histogram buckets, 2^i ns each */
+
+/**
+ * Counters of a device, kept per CPU so the hot paths never share a cache
+ * line for them. They are summed up when they are read.
+ */
+typedef struct asgn1_stats_rec {
+  u64 reads;            /* read calls, splices and block device reads */
+  u64 writes;           /* write calls and block device writes */
+  u64 read_bytes;
+  u64 write_bytes;
+  u64 page_allocs;      /* pages allocated for data */
+  u64 alloc_failures;
+  u64 faults;           /* mmap faults */
+  u64 open_busy;        /* opens refused for too many processes */
+  u64 pool_hits;        /* new pages taken from the per CPU pool */
+  u64 pool_misses;      /* new pages the pool had none ready for */
+  u64 read_lat[LAT_BUCKETS];   /* reads by log2 of their latency in ns */
+  u64 write_lat[LAT_BUCKETS];
+} asgn1_stats;
+
+/**
+ * The page index of a device. A reset swaps in an empty one and leaves the
+ * old one to be freed in the background.
+ */
+typedef struct asgn1_store_rec {
+  struct xarray pages;  /* page number -> page_node */
+  struct list_head list;  /* in the stores of the device being freed */
+} asgn1_store;
+
+#define KV_MIN_SHIFT 6                    /* smallest slot is 64 bytes */
+#define KV_CLASSES (PAGE_SHIFT - KV_MIN_SHIFT)  /* slots go up to half a page */
+
+/**
+ * A key of a key-value store and where its value is. Values of up to half
+ * a page are kept in slots of a size class, which share their pages with
+ * values of the same class. Bigger values get pages of their own.
+ */
+typedef struct kv_entry_rec {
+  struct hlist_node hash;    /* in kv_hash of the device */
+  u32 id;                    /* index in kv_ids */
+  u32 key_len;
+  loff_t offset;             /* where the value is in the ramdisk */
+  size_t len;                /* length of the value */
+  char key[];
+} kv_entry;
+
 typedef struct asgn1_dev_t {
   dev_t dev;            /* the device */
   struct cdev *cdev;
-  struct list_head mem_list; 
-  int num_pages;        /* number of memory pages this module currently holds */
-  size_t data_size;     /* total data size in this module */
+  asgn1_store __rcu *store;  /* page index, see dev_pages() */
+  atomic_long_t num_pages;  /* number of memory pages this module currently holds */
+  size_t data_size;     /* total data size in this module, holes included */
+  struct rw_semaphore sem;  /* taken for writing only to drop every page */
+  spinlock_t size_lock;     /* serialises growth of data_size */
+  spinlock_t range_lock;    /* protects ranges */
+  struct list_head ranges;  /* page ranges currently locked */
+  wait_queue_head_t range_wait;  /* waiters for a range to be unlocked */
+  struct inode *inode;  /* host of mapping */
+  struct address_space mapping;  /* mapped by every open file, see asgn1_aops */
   atomic_t nprocs;      /* number of processes accessing this device */ 
   atomic_t max_nprocs;  /* max number of processes accessing this device */
-  struct kmem_cache *cache;      /* cache memory */
-  struct class *class;     /* the udev class */
+  struct kmem_cache *cache;      /* page nodes are allocated from it */
   struct device *device;   /* the udev device node */
+  struct gendisk *disk;    /* block device front end, if there is one */
+  struct blk_mq_tag_set tag_set;
+  atomic_long_t comp_pages;  /* number of pages held compressed */
+  atomic_long_t comp_bytes;  /* size of their compressed contents */
+  struct percpu_counter comp_hits;    /* lookups finding a page uncompressed */
+  struct percpu_counter comp_misses;  /* lookups which had to decompress */
+  spinlock_t dedup_lock;     /* protects dedup_hash and the shared pages */
+  DECLARE_HASHTABLE(dedup_hash, 10);  /* shared pages by hash of contents */
+  atomic_long_t dedup_saved; /* pages saved by sharing them */
+  atomic_long_t zero_pages;  /* all-zero pages turned back into holes */
+  atomic_long_t reserved_pages;  /* preallocated pages not written to yet */
+  unsigned long max_bytes;   /* memory the pages may take, 0 for no limit,
+                                see the max_bytes parameter for overshoot */
+  unsigned long shrink_index;  /* where the shrinker carries on from */
+  int placement;             /* ASGN1_PLACE_* policy for new pages */
+  int place_node;            /* node of ASGN1_PLACE_NODE */
+  int interleave_node;       /* node the last interleaved page went to */
+  bool restoring;            /* pages are still being restored */
+  unsigned long restored;    /* pages before this one are restored */
+  wait_queue_head_t restore_wait;  /* waiters for pages being restored */
+  struct file *restore_file; /* the image being restored */
+  loff_t restore_pos;        /* next run to restore in restore_file */
+  struct work_struct restore_work;
+  asgn1_stats __percpu *stats;
+  struct dentry *debugfs;    /* debugfs directory of the device */
+  unsigned long generation;  /* bumped by every snapshot */
+  unsigned long snap_gen;    /* generation of the newest snapshot, 0 if none */
+  struct list_head snapshots;  /* open snapshots, oldest first */
+  struct mutex cow_lock;     /* serialises copying pages for a snapshot */
+  atomic_long_t snap_pages;  /* pages held only by snapshots */
+  struct xarray crcs;        /* page number -> crc32c of the page */
+  bool verify_reads;         /* check pages against their crc on read() */
+  atomic_long_t crc_errors;  /* pages found not matching their crc */
+  spinlock_t scrub_lock;     /* protects scrub */
+  struct asgn1_scrub scrub;  /* progress and results of the last scrub */
+  bool scrub_stop;           /* the module is going away */
+  struct work_struct scrub_work;
+  spinlock_t free_lock;      /* protects dying */
+  struct list_head dying;    /* old stores still being freed */
+  atomic_long_t dying_pages;  /* their pages, no longer in num_pages */
+  struct work_struct free_work;
+  struct rw_semaphore kv_sem;  /* protects the keys, taken before sem */
+  DECLARE_HASHTABLE(kv_hash, 12);  /* kv_entry by hash of its key */
+  struct xarray kv_ids;      /* id -> kv_entry, in the order scans go */
+  struct mutex kv_alloc_lock;  /* protects kv_free and kv_end */
+  struct xarray kv_free[KV_CLASSES];  /* free slots by offset >> KV_MIN_SHIFT */
+  loff_t kv_end;             /* values are only kept below this */
+  unsigned long kv_gen;      /* bumped by every reset */
 } asgn1_dev;
 
-asgn1_dev asgn1_device;
+/**
+ * A read-only point in time copy of a device, handed out as a file by
+ * TEM_SNAPSHOT. It sees the page nodes written before it was taken, that
+ * is of a generation older than its own. Such a node stays in the page
+ * index until it is written to or freed, and is then handed to the newest
+ * snapshot instead, the device carrying on with a copy. An older snapshot
+ * finds its nodes in its own index, or else in those of the snapshots
+ * after it, or else in the page index of the device.
+ */
+typedef struct asgn1_snap_rec {
+  asgn1_dev *dev;
+  unsigned long gen;         /* nodes older than this are seen */
+  size_t data_size;          /* size of the device when it was taken */
+  struct xarray pages;       /* page number -> page_node kept for it */
+  struct list_head list;     /* in the snapshots of the device */
+} asgn1_snap;
+
+asgn1_dev *asgn1_devices;                 /* one per minor */
+static dev_t asgn1_devices_dev;           /* first device number of the region */
+
+static struct class *asgn1_class;         /* the udev class */
+static int asgn1_blk_major;               /* major number of the disks */
+static struct dentry *asgn1_debugfs;      /* debugfs directory of the module */
+
+int asgn1_major = 0;                      /* major number of module */  
+int asgn1_minor = 0;                      /* first minor number of module */
+int asgn1_dev_count = 1;                  /* number of devices */
+module_param_named(devices, asgn1_dev_count, int, S_IRUGO);
+MODULE_PARM_DESC(devices, "number of independent ramdisks, /dev/asgn10 onwards");
+
+static bool mmap_fault = false;           /* map pages lazily on fault */
+module_param(mmap_fault, bool, S_IRUGO);
+MODULE_PARM_DESC(mmap_fault, "insert mmap pages from the fault handler instead of remapping them all at mmap time");
+
+static unsigned int extent_order = 0;     /* largest extent is 2^order pages */
+module_param(extent_order, uint, S_IRUGO);
+MODULE_PARM_DESC(extent_order, "back the ramdisk with extents of up to 2^extent_order pages, falling back to smaller ones (9 gives 2 MiB extents which mmap_fault maps with PMDs)");
+
+static unsigned int disk_size = 0;        /* size of each disk in MiB */
+module_param(disk_size, uint, S_IRUGO);
+MODULE_PARM_DESC(disk_size, "also export each ramdisk as a block device /dev/asgn1b0 onwards of this many MiB (0 for none)");
+
+static char *compress = NULL;             /* compression algorithm */
+module_param(compress, charp, S_IRUGO);
+MODULE_PARM_DESC(compress, "compress pages unused for a while with this crypto algorithm, e.g. lz4 or zstd (needs mmap_fault)");
+
+static bool dedup = false;                /* share identical pages */
+module_param(dedup, bool, S_IRUGO);
+MODULE_PARM_DESC(dedup, "share pages unused for a while with identical ones and turn all-zero ones into holes (needs mmap_fault)");
+
+static char *backing_file = NULL;         /* images are kept in <backing_file>.<i> */
+module_param(backing_file, charp, S_IRUGO);
+MODULE_PARM_DESC(backing_file, "save ramdisk i to <backing_file>.<i> on rmmod and restore it from there on insmod");
+
+/* Decompressing a page or unsharing a deduplicated one is never refused,
+ * so num_pages may go past the limit by up to comp_pages + dedup_saved as
+ * they stood when the limit was reached. Nothing else grows past it */
+static unsigned long max_bytes = 0;       /* initial limit of each ramdisk */
+module_param(max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(max_bytes, "memory each ramdisk may hold in bytes before writes fail with ENOSPC, 0 for no limit (changed per device in sysfs). Decompressing and unsharing pages may still go over it by up to comp_pages + dedup_saved");
+
+static char *placement = "local";        /* initial policy of each ramdisk */
+module_param(placement, charp, S_IRUGO);
+MODULE_PARM_DESC(placement, "NUMA node new pages go to: local (to the writer), interleave, or a node number (changed per device in sysfs or with TEM_SET_PLACEMENT)");
+
+static unsigned int pool_size = 64;       /* pages kept ready per CPU */
+module_param(pool_size, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_size, "zeroed pages and page nodes kept ready on each CPU for writes growing a ramdisk, refilled in bulk in the background and only used by writers in the root memory cgroup (0 for none, at most 256)");
+
+static bool checksum = false;
+module_param(checksum, bool, S_IRUGO);
+MODULE_PARM_DESC(checksum, "keep a crc32c of every page written, checked by TEM_SCRUB and by reads with verify_reads");
+
+static bool verify_reads = false;
+module_param(verify_reads, bool, S_IRUGO);
+MODULE_PARM_DESC(verify_reads, "check pages against their crc32c on read(), failing with EIO on a mismatch (changed per device in sysfs, needs checksum)");
+
+static bool kv = false;                   /* ramdisks are key-value stores */
+module_param(kv, bool, S_IRUGO);
+MODULE_PARM_DESC(kv, "make each ramdisk a key-value store, written only with TEM_KV_PUT and read with TEM_KV_GET, read() or a read-only mmap (not with disk_size or backing_file)");
+static int default_placement, default_place_node;
+
+#define SCAN_PERIOD (5 * HZ)              /* interval between cold page scans */
+
+static struct crypto_acomp *asgn1_comp_tfm;   /* NULL unless compressing */
+static struct acomp_req *asgn1_comp_req;      /* used by the scan only */
+static void *asgn1_comp_buf;                  /* compressed output of the scan */
+static struct delayed_work asgn1_scan_work;
+static DEFINE_MUTEX(asgn1_comp_lock);         /* for asgn1_comp_req and buf */
+static DEFINE_MUTEX(asgn1_inode_lock);        /* for the inode of each device */
+static struct page *asgn1_hole_page;          /* read faults on holes map it */
+static struct shrinker *asgn1_shrinker;
+
+#define POOL_MAX 256                      /* most a pool holds of each */
+#define POOL_BATCH 32                     /* allocated per bulk call */
+
+/**
+ * Zeroed pages and page nodes kept ready for one CPU, so growing the
+ * ramdisk by a page doesn't go to the page or slab allocator. Its pages
+ * come from the node of the CPU. A worker on the CPU refills it in bulk
+ * once it is down to half of pool_size.
+ */
+typedef struct asgn1_pool_rec {
+  spinlock_t lock;      /* only contended by the refill and the shrinker */
+  unsigned int nr_pages;
+  unsigned int nr_nodes;
+  struct page *pages[POOL_MAX];
+  page_node *nodes[POOL_MAX];
+  struct work_struct refill;
+  int cpu;
+} asgn1_pool;
+
+static asgn1_pool __percpu *asgn1_pools;     /* NULL if pool_size is 0 */
+static struct kmem_cache *asgn1_node_cache;  /* every device's page nodes */
+
+
+/**
+ * Returns the kernel address of byte offset of the ramdisk, which must lie
+ * in the extent of curr.
+ */
+static inline void *node_address(page_node *curr, loff_t offset) {
+  return page_address(curr->page) + (offset - ((loff_t)curr->index << PAGE_SHIFT));
+}
+
+
+/**
+ * Returns the page index of the device. A reset only replaces it with
+ * dev->sem held for writing, and frees the old one after a grace period,
+ * so the caller must hold dev->sem or be in an RCU read-side section.
+ */
+static inline struct xarray *dev_pages(asgn1_dev *dev) {
+  return &rcu_dereference_check(dev->store,
+      lockdep_is_held(&dev->sem))->pages;
+}
+
+
+/**
+ * Returns the number of bytes from offset to the end of the extent of curr.
+ */
+static inline size_t node_bytes_left(page_node *curr, loff_t offset) {
+  return ((loff_t)(curr->index + (1UL << curr->order)) << PAGE_SHIFT) - offset;
+}
+
+
+#define CRC_STALE XA_MARK_0  /* in crcs: may be changing through a mapping */
+
+/**
+ * Returns the checksum of a page as kept in dev->crcs. Value entries only
+ * hold 31 bits on 32-bit, where the top bit is dropped.
+ */
+static inline unsigned long page_crc(struct page *page) {
+  return crc32c(~0, page_address(page), PAGE_SIZE) & LONG_MAX;
+}
+
+
+/**
+ * Records the checksums of the pages first to last, which must lie in the
+ * extent of curr. The caller must hold the pages locked for writing.
+ */
+static void update_crcs(asgn1_dev *dev, page_node *curr, unsigned long first,
+    unsigned long last) {
+  unsigned long index;
+
+  if (!checksum) return;
+  /* Without memory for the entry the page just goes unchecked */
+  for (index = first; index <= last; index++)
+    xa_store(&dev->crcs, index,
+        xa_mk_value(page_crc(nth_page(curr->page, index - curr->index))),
+        GFP_KERNEL);
+}
+
+
+/**
+ * Forgets the checksums of the pages first to last, which are holes now.
+ */
+static void forget_crcs(asgn1_dev *dev, unsigned long first,
+    unsigned long last) {
+  unsigned long index;
+  void *entry;
+
+  xa_for_each_range(&dev->crcs, index, entry, first, last)
+    xa_erase(&dev->crcs, index);
+}
+
+
+/**
+ * Marks the checksums of the pages first to last as stale, as they are
+ * about to be mapped for writing. Returns -ENOMEM if there is not enough
+ * memory to do so.
+ */
+static int mark_crcs_stale(asgn1_dev *dev, unsigned long first,
+    unsigned long last) {
+  XA_STATE(xas, &dev->crcs, first);
+  unsigned long index;
+
+  if (!checksum) return 0;
+  for (index = first; index <= last; index++) {
+    xas_set(&xas, index);
+    do {
+      xas_lock(&xas);
+      if (xas_load(&xas) == NULL) xas_store(&xas, xa_mk_value(0));
+      if (!xas_error(&xas)) xas_set_mark(&xas, CRC_STALE);
+      xas_unlock(&xas);
+    } while (xas_nomem(&xas, GFP_KERNEL));
+    if (xas_error(&xas)) return xas_error(&xas);
+  }
+  return 0;
+}
+
+
+/**
+ * Checks page, page number index of the device, against its checksum,
+ * unless it has none or may be changing through a mapping. Returns false,
+ * counting the error, if they don't match.
+ */
+static bool check_crc(asgn1_dev *dev, struct page *page, unsigned long index) {
+  void *entry = xa_load(&dev->crcs, index);
+
+  if (entry == NULL || xa_get_mark(&dev->crcs, index, CRC_STALE)) return true;
+  if (xa_to_value(entry) == page_crc(page)) return true;
+  atomic_long_inc(&dev->crc_errors);
+  printk_ratelimited(KERN_WARNING "%s: page %lu of %s doesn't match its checksum\n",
+      MYDEV_NAME, index, dev_name(dev->device));
+  return false;
+}
+
+
+/**
+ * Counts a read or write of len bytes at pos of the device which moved
+ * bytes (or failed if negative) and started at start, in ns, and traces it.
+ */
+static void account_io(asgn1_dev *dev, bool write, loff_t pos, size_t len,
+    ssize_t bytes, u64 start) {
+  u64 duration = ktime_get_ns() - start;
+  unsigned int bucket = min_t(unsigned int, ilog2(duration | 1),
+      LAT_BUCKETS - 1);
+  unsigned long pages = 0;
+
+  if (bytes > 0)
+    pages = ((pos + bytes - 1) >> PAGE_SHIFT) - (pos >> PAGE_SHIFT) + 1;
+  if (write) trace_asgn1_write(dev->dev, pos, len, pages, bytes, duration);
+  else trace_asgn1_read(dev->dev, pos, len, pages, bytes, duration);
+
+  if (write) {
+    this_cpu_inc(dev->stats->writes);
+    if (bytes > 0) this_cpu_add(dev->stats->write_bytes, bytes);
+    this_cpu_inc(dev->stats->write_lat[bucket]);
+  } else {
+    this_cpu_inc(dev->stats->reads);
+    if (bytes > 0) this_cpu_add(dev->stats->read_bytes, bytes);
+    this_cpu_inc(dev->stats->read_lat[bucket]);
+  }
+}
+
+
+/**
+ * Sums the counter at offset in asgn1_stats over every CPU.
+ */
+static u64 sum_stat(asgn1_dev *dev, size_t offset) {
+  u64 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    sum += *(u64 *)((char *)per_cpu_ptr(dev->stats, cpu) + offset);
+  return sum;
+}
+
+
+/**
+ * This function removes every user mapping of the pages first to last, so
+ * none of them can be reached once they are freed.
+ */
+static void zap_mappings(asgn1_dev *dev, unsigned long first, unsigned long last) {
+  unmap_mapping_pages(&dev->mapping, first, last - first + 1, true);
+}
+
+
+/**
+ * This function removes the mappings of the hole page over the pages of
+ * curr, which was just stored where there was a hole, so the next access
+ * faults in the new page. Private copies of the hole page are kept. Locking
+ * the hole page waits out a fault which is about to map it there.
+ */
+static void unmap_hole(asgn1_dev *dev, page_node *curr) {
+  struct folio *folio = page_folio(asgn1_hole_page);
+
+  folio_lock(folio);
+  unmap_mapping_pages(&dev->mapping, curr->index, 1UL << curr->order, false);
+  folio_unlock(folio);
+}
+
+
+/**
+ * RCU callback freeing a page node once no lockless reader can still be
+ * using it. Readers holding their own reference keep the page alive.
+ */
+static void page_node_free_rcu(struct rcu_head *head) {
+  page_node *curr = container_of(head, page_node, rcu);
+
+  if (curr->page) folio_put(page_folio(curr->page));
+  kfree(curr->zdata);
+  kfree(curr);
+}
+
+
+/**
+ * Drops curr from the sharers of its shared page. Returns whether it was
+ * the last one, the page then goes when the node does.
+ */
+static bool leave_shared_page(asgn1_dev *dev, page_node *curr) {
+  shared_page *shared = curr->shared;
+  bool last;
+
+  spin_lock(&dev->dedup_lock);
+  last = --shared->sharers == 0;
+  if (last) hash_del(&shared->hash);
+  else atomic_long_dec(&dev->dedup_saved);
+  spin_unlock(&dev->dedup_lock);
+
+  curr->shared = NULL;
+  if (last) kfree(shared);
+  return last;
+}
+
+
+/**
+ * Takes curr's page out of the dedup hash table if curr is its only sharer,
+ * so the page can be changed. Returns false if others share the page.
+ */
+static bool detach_shared_page(asgn1_dev *dev, page_node *curr) {
+  shared_page *shared = curr->shared;
+
+  spin_lock(&dev->dedup_lock);
+  if (shared->sharers > 1) {
+    spin_unlock(&dev->dedup_lock);
+    return false;
+  }
+  hash_del(&shared->hash);
+  spin_unlock(&dev->dedup_lock);
+
+  WRITE_ONCE(curr->shared, NULL);
+  kfree(shared);
+  return true;
+}
+
+
+/**
+ * This function frees a page node which has already been taken out of the
+ * page index, uncounting its pages from held. The memory goes back once an
+ * RCU grace period has passed.
+ */
+static void __free_page_node(asgn1_dev *dev, page_node *curr,
+    atomic_long_t *held) {
+  if (test_and_clear_bit(NODE_RESERVED, &curr->flags))
+    atomic_long_sub(1UL << curr->order, &dev->reserved_pages);
+  /* Detach pages handed out by the fault handler from the file. The page
+   * lock waits for a fault still installing the page in a mapping */
+  if (curr->page) {
+    lock_page(curr->page);
+    curr->page->mapping = NULL;
+    unlock_page(curr->page);
+    if (curr->shared == NULL || leave_shared_page(dev, curr))
+      atomic_long_sub(1UL << curr->order, held);
+  } else {
+    atomic_long_dec(&dev->comp_pages);
+    atomic_long_sub(curr->zlen, &dev->comp_bytes);
+  }
+  call_rcu(&curr->rcu, page_node_free_rcu);
+}
+
+static void free_page_node(asgn1_dev *dev, page_node *curr) {
+  __free_page_node(dev, curr, &dev->num_pages);
+}
+
+
+/**
+ * Counts a preallocated page node as used, the first time it is written to.
+ */
+static inline void unreserve_page_node(asgn1_dev *dev, page_node *curr) {
+  if (unlikely(test_bit(NODE_RESERVED, &curr->flags)) &&
+      test_and_clear_bit(NODE_RESERVED, &curr->flags))
+    atomic_long_sub(1UL << curr->order, &dev->reserved_pages);
+}
+
+
+/**
+ * Stores curr at every page number of its extent in pages. Returns -EBUSY
+ * if any of them is taken already.
+ */
+static int __store_page_node(struct xarray *pages, page_node *curr,
+    gfp_t gfp) {
+  XA_STATE_ORDER(xas, pages, curr->index, curr->order);
+
+  do {
+    xas_lock(&xas);
+    if (xas_find_conflict(&xas)) xas_set_err(&xas, -EBUSY);
+    else xas_store(&xas, curr);
+    xas_unlock(&xas);
+  } while (xas_nomem(&xas, gfp));
+
+  return xas_error(&xas);
+}
+
+
+/**
+ * Hands curr, which has just been taken out of the page index, over to the
+ * newest snapshot. The caller must hold dev->sem.
+ */
+static void keep_for_snapshot(asgn1_dev *dev, page_node *curr) {
+  asgn1_snap *snap = list_last_entry(&dev->snapshots, asgn1_snap, list);
+
+  unreserve_page_node(dev, curr);
+  /* Nothing else can be stored there, only one node of each page number
+   * is ever handed to a snapshot */
+  __store_page_node(&snap->pages, curr, GFP_KERNEL | __GFP_NOFAIL);
+  atomic_long_add(1UL << curr->order, &dev->snap_pages);
+}
+
+
+/**
+ * This function frees a page node which has been taken out of the page
+ * index, unless a snapshot still needs it, which then gets it instead. The
+ * caller must hold dev->sem and, unless for writing, the extent locked for
+ * writing.
+ */
+static void drop_page_node(asgn1_dev *dev, page_node *curr) {
+  if (curr->gen >= dev->snap_gen) {
+    free_page_node(dev, curr);
+    return;
+  }
+  /* Its pages belong to no file any more, as in free_page_node */
+  if (curr->page) {
+    lock_page(curr->page);
+    curr->page->mapping = NULL;
+    unlock_page(curr->page);
+  }
+  keep_for_snapshot(dev, curr);
+}
+
+
+/**
+ * Forgets what is left of the contents of the device once its pages are
+ * gone, with dev->sem held for writing.
+ */
+static void forget_contents(asgn1_dev *dev) {
+  dev->data_size = 0;
+  xa_destroy(&dev->crcs);
+
+  /* Whatever is still being restored belongs to the old contents */
+  if (dev->restoring) {
+    WRITE_ONCE(dev->restoring, false);
+    wake_up_all(&dev->restore_wait);
+  }
+}
+
+
+/**
+ * This function frees all memory pages held by the module. The caller
+ * must hold dev->sem for writing. Pages snapshots still need are handed
+ * to them.
+ */
+void free_memory_pages(asgn1_dev *dev) {
+  page_node *curr;
+  unsigned long index;
+
+  zap_mappings(dev, 0, ULONG_MAX >> PAGE_SHIFT);
+
+  /* Loop through the page index, extents only show up once */
+  xa_for_each(dev_pages(dev), index, curr) {
+    /* If a page has been allocated, free it. The node is then removed */
+    xa_erase(dev_pages(dev), index);
+    drop_page_node(dev, curr);
+  }
+
+  /* A fault may have mapped one of the pages since the first zap */
+  zap_mappings(dev, 0, ULONG_MAX >> PAGE_SHIFT);
+  forget_contents(dev);
+}
+
+
+#define FREE_BATCH 256            /* page nodes freed between reschedules */
+
+/**
+ * Frees the old stores a reset left behind, oldest first, FREE_BATCH page
+ * nodes at a time. Their pages are counted in dying_pages until then.
+ */
+static void asgn1_free_stores(struct work_struct *work) {
+  asgn1_dev *dev = container_of(work, asgn1_dev, free_work);
+  asgn1_store *store;
+  page_node *curr;
+  unsigned long index;
+  unsigned long freed = 0;
+
+  for (;;) {
+    spin_lock(&dev->free_lock);
+    store = list_first_entry_or_null(&dev->dying, asgn1_store, list);
+    spin_unlock(&dev->free_lock);
+    if (store == NULL) break;
+
+    /* Wait for lockless readers which found the store before the reset */
+    synchronize_rcu();
+    xa_for_each(&store->pages, index, curr) {
+      xa_erase(&store->pages, index);
+      __free_page_node(dev, curr, &dev->dying_pages);
+      if (++freed % FREE_BATCH == 0) cond_resched();
+    }
+    xa_destroy(&store->pages);
+
+    spin_lock(&dev->free_lock);
+    list_del(&store->list);
+    spin_unlock(&dev->free_lock);
+    kfree(store);
+  }
+
+  /* A fault may have mapped one of the pages just before the reset. Only
+   * faulting mappings can have, and they are faulted in again */
+  if (mmap_fault && freed) zap_mappings(dev, 0, ULONG_MAX >> PAGE_SHIFT);
+}
+
+
+/**
+ * Empties the device like free_memory_pages(), but only swaps in an empty
+ * page index and leaves the old one to asgn1_free_stores(), so resetting a
+ * large device returns at once. The old pages stop counting against
+ * max_bytes straight away, so the device can be filled again at once. Pages
+ * go the slow way if snapshots still need some, or there is no memory for a
+ * new index. The caller must hold dev->sem for writing.
+ */
+static void detach_memory_pages(asgn1_dev *dev) {
+  asgn1_store *old = rcu_dereference_protected(dev->store,
+      lockdep_is_held(&dev->sem));
+  asgn1_store *store;
+  shared_page *shared;
+  struct hlist_node *tmp;
+  int bkt;
+
+  if (!list_empty(&dev->snapshots)) goto sync;
+  store = kmalloc(sizeof(asgn1_store), GFP_KERNEL);
+  if (store == NULL) goto sync;
+  xa_init(&store->pages);
+
+  zap_mappings(dev, 0, ULONG_MAX >> PAGE_SHIFT);
+  rcu_assign_pointer(dev->store, store);
+  /* Nothing else changes num_pages with dev->sem held for writing */
+  atomic_long_add(atomic_long_xchg(&dev->num_pages, 0), &dev->dying_pages);
+  /* New pages mustn't share old ones, which no longer count in num_pages.
+   * The old sharers still point at theirs, and hash_del() of an entry
+   * already taken out does nothing */
+  spin_lock(&dev->dedup_lock);
+  hash_for_each_safe(dev->dedup_hash, bkt, tmp, shared, hash)
+    hash_del(&shared->hash);
+  spin_unlock(&dev->dedup_lock);
+  spin_lock(&dev->free_lock);
+  list_add_tail(&old->list, &dev->dying);
+  spin_unlock(&dev->free_lock);
+  queue_work(system_unbound_wq, &dev->free_work);
+
+  forget_contents(dev);
+  return;
+
+sync:
+  free_memory_pages(dev);
+}
+
+
+/**
+ * Returns whether none of the pages of the extent of the given order which
+ * contains page number index are held yet.
+ */
+static bool extent_is_free(asgn1_dev *dev, unsigned long index,
+    unsigned int order) {
+  unsigned long first = round_down(index, 1UL << order);
+
+  return xa_find(dev_pages(dev), &first, first + (1UL << order) - 1,
+      XA_PRESENT) == NULL;
+}
+
+
+/**
+ * Stores curr in the page index at every page number of its extent.
+ * Fails with -EBUSY if any of them has been filled already.
+ */
+static int store_page_node(asgn1_dev *dev, page_node *curr) {
+  return __store_page_node(dev_pages(dev), curr, GFP_KERNEL);
+}
+
+
+/**
+ * Checks a placement policy and its node, as given to the module, sysfs or
+ * the TEM_SET_PLACEMENT ioctl.
+ */
+static int check_placement(int policy, int node) {
+  switch (policy) {
+    case ASGN1_PLACE_LOCAL:
+    case ASGN1_PLACE_INTERLEAVE:
+      return 0;
+    case ASGN1_PLACE_NODE:
+      if (node < 0 || node >= MAX_NUMNODES || !node_state(node, N_MEMORY))
+        return -EINVAL;
+      return 0;
+    default:
+      return -EINVAL;
+  }
+}
+
+
+/**
+ * Parses "local", "interleave" or a node number into a placement policy.
+ */
+static int parse_placement(const char *buf, int *policy, int *node) {
+  int result;
+
+  *node = NUMA_NO_NODE;
+  if (sysfs_streq(buf, "local")) {
+    *policy = ASGN1_PLACE_LOCAL;
+  } else if (sysfs_streq(buf, "interleave")) {
+    *policy = ASGN1_PLACE_INTERLEAVE;
+  } else {
+    result = kstrtoint(buf, 0, node);
+    if (result < 0) return result;
+    *policy = ASGN1_PLACE_NODE;
+  }
+  return check_placement(*policy, *node);
+}
+
+
+/**
+ * Changes the placement policy of the device. Pages already held stay
+ * where they are.
+ */
+static void set_placement(asgn1_dev *dev, int policy, int node) {
+  /* An allocation racing with this sees a valid node either way */
+  WRITE_ONCE(dev->place_node, node);
+  WRITE_ONCE(dev->placement, policy);
+}
+
+
+/**
+ * Allocates a folio for the ramdisk on the node its placement policy picks.
+ * Local placement leaves it to the memory policy of the calling task,
+ * which puts it on the node the writer runs on unless told otherwise. A
+ * full node falls back to the others rather than failing.
+ */
+static struct folio *asgn1_folio_alloc(asgn1_dev *dev, gfp_t gfp,
+    unsigned int order) {
+  int node;
+
+  switch (READ_ONCE(dev->placement)) {
+    case ASGN1_PLACE_INTERLEAVE:
+      /* A lost race only puts two pages on the same node */
+      node = next_node_in(READ_ONCE(dev->interleave_node),
+          node_states[N_MEMORY]);
+      WRITE_ONCE(dev->interleave_node, node);
+      break;
+    case ASGN1_PLACE_NODE:
+      node = READ_ONCE(dev->place_node);
+      break;
+    default:
+      return folio_alloc(gfp, order);
+  }
+  return __folio_alloc_node(gfp, order, node);
+}
+
+
+/**
+ * Allocates a single page for the ramdisk like asgn1_folio_alloc().
+ */
+static struct page *asgn1_page_alloc(asgn1_dev *dev, gfp_t gfp) {
+  struct folio *folio = asgn1_folio_alloc(dev, gfp, 0);
+  return folio ? &folio->page : NULL;
+}
+
+
+/**
+ * Takes a page, or a page node, from the pool of this CPU. Returns NULL if
+ * there are none left. The pool is refilled once it is down to half full.
+ */
+static void *pool_take(bool node) {
+  asgn1_pool *pool;
+  void *entry = NULL;
+  unsigned int left;
+
+  if (asgn1_pools == NULL) return NULL;
+  /* Being moved to another CPU meanwhile only takes from its pool */
+  pool = raw_cpu_ptr(asgn1_pools);
+  spin_lock(&pool->lock);
+  if (node) {
+    if (pool->nr_nodes) entry = pool->nodes[--pool->nr_nodes];
+    left = pool->nr_nodes;
+  } else {
+    if (pool->nr_pages) entry = pool->pages[--pool->nr_pages];
+    left = pool->nr_pages;
+  }
+  spin_unlock(&pool->lock);
+
+  if (left < pool_size / 2) queue_work_on(pool->cpu, system_wq, &pool->refill);
+  return entry;
+}
+
+
+/**
+ * Fills the pool of a CPU back up to pool_size, POOL_BATCH pages and nodes
+ * at a time. Allocations don't try hard, a pool short of memory is simply
+ * left short until the next refill.
+ */
+static void pool_refill(struct work_struct *work) {
+  asgn1_pool *pool = container_of(work, asgn1_pool, refill);
+  struct page *pages[POOL_BATCH];
+  void *nodes[POOL_BATCH];
+  unsigned int want, got, used;
+
+  for (;;) {
+    spin_lock(&pool->lock);
+    want = min_t(unsigned int, pool_size - pool->nr_pages, POOL_BATCH);
+    spin_unlock(&pool->lock);
+    if (want == 0) break;
+
+    memset(pages, 0, sizeof(pages));
+    got = alloc_pages_bulk_node(GFP_KERNEL | __GFP_ZERO | __GFP_NORETRY |
+        __GFP_NOWARN, cpu_to_node(pool->cpu), want, pages);
+    spin_lock(&pool->lock);
+    used = min(got, pool_size - pool->nr_pages);
+    memcpy(&pool->pages[pool->nr_pages], pages, used * sizeof(*pages));
+    pool->nr_pages += used;
+    spin_unlock(&pool->lock);
+    /* Someone refilled it meanwhile */
+    while (got > used) __free_page(pages[--got]);
+    if (got < want) break;
+  }
+
+  for (;;) {
+    spin_lock(&pool->lock);
+    want = min_t(unsigned int, pool_size - pool->nr_nodes, POOL_BATCH);
+    spin_unlock(&pool->lock);
+    if (want == 0) break;
+
+    got = kmem_cache_alloc_bulk(asgn1_node_cache, GFP_KERNEL | __GFP_NOWARN,
+        want, nodes);
+    if (got == 0) break;
+    spin_lock(&pool->lock);
+    used = min(got, pool_size - pool->nr_nodes);
+    memcpy(&pool->nodes[pool->nr_nodes], nodes, used * sizeof(*nodes));
+    pool->nr_nodes += used;
+    spin_unlock(&pool->lock);
+    if (got > used) kmem_cache_free_bulk(asgn1_node_cache, got - used,
+        &nodes[used]);
+  }
+}
+
+
+/**
+ * Frees up to nr of the pages kept in the pools, for the shrinker. Returns
+ * the number freed.
+ */
+static unsigned long pool_shrink(unsigned long nr) {
+  asgn1_pool *pool;
+  struct page *page;
+  unsigned long freed = 0;
+  int cpu;
+
+  if (asgn1_pools == NULL) return 0;
+  for_each_possible_cpu(cpu) {
+    pool = per_cpu_ptr(asgn1_pools, cpu);
+    while (freed < nr) {
+      spin_lock(&pool->lock);
+      page = pool->nr_pages ? pool->pages[--pool->nr_pages] : NULL;
+      spin_unlock(&pool->lock);
+      if (page == NULL) break;
+      __free_page(page);
+      freed++;
+    }
+  }
+  return freed;
+}
+
+
+/**
+ * Returns the number of pages kept in the pools.
+ */
+static unsigned long pool_count(void) {
+  unsigned long count = 0;
+  int cpu;
+
+  if (asgn1_pools == NULL) return 0;
+  for_each_possible_cpu(cpu)
+    count += READ_ONCE(per_cpu_ptr(asgn1_pools, cpu)->nr_pages);
+  return count;
+}
+
+
+/**
+ * Returns whether what the pools hold may be handed to the current task.
+ * They were allocated by the refill worker and so are charged to no memory
+ * cgroup, which only a task in the root cgroup may be given. Tasks in any
+ * other have theirs allocated and charged as they write.
+ */
+static bool pool_allowed(void) {
+  struct mem_cgroup *memcg;
+  bool root;
+
+  if (mem_cgroup_disabled()) return true;
+  memcg = get_mem_cgroup_from_mm(current->mm);
+  root = mem_cgroup_is_root(memcg);
+  mem_cgroup_put(memcg);
+  return root;
+}
+
+
+/**
+ * Allocates a page node, from the pool of this CPU if it has one ready and
+ * the node needn't be charged to a cgroup the pool can't charge.
+ * Its fields are left for the caller to fill in.
+ */
+static page_node *new_page_node(asgn1_dev *dev, gfp_t gfp) {
+  page_node *curr = NULL;
+
+  if (asgn1_pools && (!(gfp & __GFP_ACCOUNT) || pool_allowed()))
+    curr = pool_take(true);
+  return curr ?: kmem_cache_alloc(dev->cache, gfp);
+}
+
+
+/**
+ * Takes a zeroed page for dev from the pool of this CPU, counting a hit or
+ * a miss. Only local placement uses the pool, as its pages are on the node
+ * of the CPU, and only writers pool_allowed() lets have them, as they are
+ * charged to no memory cgroup.
+ */
+static struct folio *pool_folio(asgn1_dev *dev) {
+  struct page *page;
+
+  if (asgn1_pools == NULL || READ_ONCE(dev->placement) != ASGN1_PLACE_LOCAL ||
+      !pool_allowed())
+    return NULL;
+  page = pool_take(false);
+  if (page == NULL) {
+    this_cpu_inc(dev->stats->pool_misses);
+    return NULL;
+  }
+  this_cpu_inc(dev->stats->pool_hits);
+  return page_folio(page);
+}
+
+
+/**
+ * Counts nr more pages against the limit of the device. Returns false,
+ * counting nothing, if they would take it over the limit.
+ */
+static bool charge_pages(asgn1_dev *dev, unsigned long nr) {
+  unsigned long limit = READ_ONCE(dev->max_bytes) >> PAGE_SHIFT;
+
+  if (atomic_long_add_return(nr, &dev->num_pages) <= limit || limit == 0)
+    return true;
+  atomic_long_sub(nr, &dev->num_pages);
+  return false;
+}
+
+
+/**
+ * This function allocates a new zeroed page node holding page number index
+ * and stores it in the page index. The largest extent up to extent_order
+ * that doesn't overlap pages already held is tried first, falling back to
+ * smaller ones when the allocator can't find one. If another caller got
+ * there first, their node is returned instead. ERR_PTR(-ENOSPC) is returned
+ * if the device is at its limit, ERR_PTR(-ENOMEM) if there is not enough
+ * memory. The memory is charged to the memory cgroup of the caller.
+ */
+static page_node *alloc_page_node(asgn1_dev *dev, unsigned long index) {
+  page_node *curr;
+  struct folio *folio = NULL;
+  unsigned int order = 0;
+  bool pooled;
+  int result = -ENOMEM;
+  u64 start = trace_asgn1_page_alloc_enabled() ? ktime_get_ns() : 0;
+
+  curr = new_page_node(dev, GFP_KERNEL_ACCOUNT);
+  if (curr == NULL) goto fail_node;
+
+retry:
+  pooled = false;
+  for (order = extent_order; order > 0; order--) {
+    if (!extent_is_free(dev, index, order)) continue;
+    if (!charge_pages(dev, 1UL << order)) continue;
+    folio = asgn1_folio_alloc(dev, GFP_KERNEL_ACCOUNT | __GFP_ZERO |
+        __GFP_NOWARN | __GFP_NORETRY, order);
+    if (folio) break;
+    atomic_long_sub(1UL << order, &dev->num_pages);
+  }
+  if (folio == NULL) {
+    if (!charge_pages(dev, 1)) {
+      result = -ENOSPC;
+      goto fail_page;
+    }
+    folio = pool_folio(dev);
+    pooled = folio != NULL;
+    if (folio == NULL)
+      folio = asgn1_folio_alloc(dev, GFP_KERNEL_ACCOUNT | __GFP_ZERO, 0);
+    if (folio == NULL) {
+      atomic_long_dec(&dev->num_pages);
+      goto fail_page;
+    }
+  }
+
+  curr->page = &folio->page;
+  curr->order = order;
+  curr->index = round_down(index, 1UL << order);
+  curr->referenced = true;
+  curr->zdata = NULL;
+  curr->zlen = 0;
+  curr->shared = NULL;
+  curr->flags = 0;
+  curr->gen = dev->generation;
+
+  result = store_page_node(dev, curr);
+  if (result == -EBUSY) {
+    /* Someone else filled part of the extent meanwhile. Use their node if
+     * it holds index, otherwise try again around it */
+    folio_put(folio);
+    folio = NULL;
+    atomic_long_sub(1UL << order, &dev->num_pages);
+    if (xa_load(dev_pages(dev), index)) {
+      kfree(curr);
+      return xa_load(dev_pages(dev), index);
+    }
+    goto retry;
+  }
+  if (result) goto fail_store;
+  if (mmap_fault && mapping_mapped(&dev->mapping)) unmap_hole(dev, curr);
+  this_cpu_add(dev->stats->page_allocs, 1UL << order);
+  if (start)
+    trace_asgn1_page_alloc(dev->dev, curr->index, order, folio_nid(folio),
+        pooled, 0, ktime_get_ns() - start);
+  return curr;
+
+  /* cleanup code called when any of the allocation steps fail */
+fail_store:
+  folio_put(folio);
+  atomic_long_sub(1UL << order, &dev->num_pages);
+fail_page:
+  kfree(curr);
+fail_node:
+  this_cpu_inc(dev->stats->alloc_failures);
+  if (start)
+    trace_asgn1_page_alloc(dev->dev, index, 0, NUMA_NO_NODE, false, result,
+        ktime_get_ns() - start);
+  return ERR_PTR(result);
+}
+
+
+/**
+ * This function decompresses the compressed page curr into page.
+ */
+static int decompress_page(page_node *curr, struct page *page) {
+  struct acomp_req *req;
+  struct crypto_wait wait;
+  struct scatterlist src, dst;
+  int result;
+
+  req = acomp_request_alloc(asgn1_comp_tfm);
+  if (req == NULL) return -ENOMEM;
+
+  crypto_init_wait(&wait);
+  sg_init_one(&src, curr->zdata, curr->zlen);
+  sg_init_table(&dst, 1);
+  sg_set_page(&dst, page, PAGE_SIZE, 0);
+  acomp_request_set_params(req, &src, &dst, curr->zlen, PAGE_SIZE);
+  acomp_request_set_callback(req, CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done,
+      &wait);
+  result = crypto_wait_req(crypto_acomp_decompress(req), &wait);
+  if (result == 0 && req->dlen != PAGE_SIZE) result = -EIO;
+  if (result < 0)
+    printk(KERN_WARNING "%s: Couldn't decompress page %lu\n", MYDEV_NAME,
+        curr->index);
+  acomp_request_free(req);
+  return result;
+}
+
+
+/**
+ * This function brings the compressed page curr back into memory, replacing
+ * it in the page index. The caller must hold dev->sem for reading and the
+ * page locked for writing. Returns the new node, or NULL if there is not
+ * enough memory.
+ */
+static page_node *decompress_page_node(asgn1_dev *dev, page_node *curr) {
+  page_node *new;
+  struct page *page;
+
+  new = new_page_node(dev, GFP_KERNEL);
+  page = asgn1_page_alloc(dev, GFP_KERNEL);
+  if (new == NULL || page == NULL) goto fail;
+  if (decompress_page(curr, page) < 0) goto fail;
+
+  new->page = page;
+  new->index = curr->index;
+  new->order = 0;
+  new->referenced = true;
+  new->zdata = NULL;
+  new->zlen = 0;
+  new->shared = NULL;
+  new->flags = 0;
+  new->gen = curr->gen;
+  /* Replacing an entry needs no memory */
+  xa_store(dev_pages(dev), curr->index, new, GFP_KERNEL);
+  atomic_long_inc(&dev->num_pages);
+  free_page_node(dev, curr);
+  percpu_counter_inc(&dev->comp_misses);
+  return new;
+
+fail:
+  if (page) __free_page(page);
+  kfree(new);
+  return NULL;
+}
+
+
+/**
+ * This function gives a page shared with identical ones to curr alone, by
+ * copying it unless curr is the last sharer. The caller must hold dev->sem
+ * for reading and the page locked for writing. Returns the node now holding
+ * the page, or NULL if there is not enough memory.
+ */
+static page_node *unshare_page_node(asgn1_dev *dev, page_node *curr) {
+  page_node *new;
+  struct page *page;
+
+  if (detach_shared_page(dev, curr)) return curr;
+
+  new = new_page_node(dev, GFP_KERNEL);
+  page = asgn1_page_alloc(dev, GFP_KERNEL);
+  if (new == NULL || page == NULL) {
+    if (page) __free_page(page);
+    kfree(new);
+    return NULL;
+  }
+  copy_highpage(page, curr->page);
+
+  new->page = page;
+  new->index = curr->index;
+  new->order = 0;
+  new->referenced = true;
+  new->zdata = NULL;
+  new->zlen = 0;
+  new->shared = NULL;
+  new->flags = 0;
+  new->gen = curr->gen;
+  xa_store(dev_pages(dev), curr->index, new, GFP_KERNEL);
+  atomic_long_inc(&dev->num_pages);
+  free_page_node(dev, curr);
+  return new;
+}
+
+
+/**
+ * Returns a node for the page of curr which can be written to, after
+ * decompressing or unsharing it. The caller must hold dev->sem for reading
+ * and the page locked for writing. NULL is returned if there is not enough
+ * memory.
+ */
+static page_node *own_page_node(asgn1_dev *dev, page_node *curr) {
+  if (curr->page == NULL) return decompress_page_node(dev, curr);
+  if (curr->shared) return unshare_page_node(dev, curr);
+  return curr;
+}
+
+
+/**
+ * This function copies the extent of curr if the newest snapshot was taken
+ * after it was written, handing curr to the snapshot and putting the copy
+ * in the page index. A compressed page is copied by decompressing it. The
+ * copy, or curr if none was needed, is returned. The copy counts against
+ * the limit, ERR_PTR(-ENOSPC) is returned if it would go over it and
+ * ERR_PTR(-ENOMEM) if there is not enough memory. The caller must hold
+ * dev->sem for reading and some of the extent locked for writing, writers
+ * of other parts of it copy it in turn.
+ */
+static page_node *cow_page_node(asgn1_dev *dev, page_node *curr) {
+  unsigned long index = curr->index;
+  page_node *new = NULL;
+  struct folio *folio;
+  unsigned int i;
+  int result = -ENOMEM;
+
+  if (likely(curr->gen >= dev->snap_gen)) return curr;
+
+  mutex_lock(&dev->cow_lock);
+  /* Another writer to the extent may have copied it meanwhile */
+  curr = xa_load(dev_pages(dev), index);
+  if (curr->gen >= dev->snap_gen) goto out;
+
+  new = new_page_node(dev, GFP_KERNEL_ACCOUNT);
+  if (new == NULL) {
+    curr = ERR_PTR(-ENOMEM);
+    goto out;
+  }
+  /* Unlike decompressing or unsharing in place, a copy for a snapshot
+   * leaves the old pages held, so it is held to the limit */
+  if (!charge_pages(dev, 1UL << curr->order)) {
+    result = -ENOSPC;
+    goto fail;
+  }
+  folio = asgn1_folio_alloc(dev, GFP_KERNEL_ACCOUNT, curr->order);
+  if (folio == NULL) goto fail_charge;
+  if (curr->page == NULL) {
+    if (decompress_page(curr, &folio->page) < 0) {
+      folio_put(folio);
+      goto fail_charge;
+    }
+  } else {
+    for (i = 0; i < 1U << curr->order; i++)
+      copy_highpage(folio_page(folio, i), nth_page(curr->page, i));
+  }
+
+  new->page = &folio->page;
+  new->index = curr->index;
+  new->order = curr->order;
+  new->referenced = true;
+  new->zdata = NULL;
+  new->zlen = 0;
+  new->shared = NULL;
+  new->flags = 0;
+  new->gen = dev->generation;
+  /* Replacing an entry needs no memory */
+  xa_store(dev_pages(dev), index, new, GFP_KERNEL);
+  keep_for_snapshot(dev, curr);
+  /* Mappings of the old pages fault the copy in again */
+  zap_mappings(dev, curr->index, curr->index + (1UL << curr->order) - 1);
+  curr = new;
+
+out:
+  mutex_unlock(&dev->cow_lock);
+  return curr;
+
+fail_charge:
+  atomic_long_sub(1UL << curr->order, &dev->num_pages);
+fail:
+  mutex_unlock(&dev->cow_lock);
+  kfree(new);
+  return ERR_PTR(result);
+}
+
+
+/**
+ * Returns a node for the page of curr which can be written to, after
+ * copying it for a snapshot, decompressing or unsharing it. The caller
+ * must hold dev->sem for reading and the page locked for writing.
+ * ERR_PTR(-ENOSPC) is returned if a copy would go over the limit, and
+ * ERR_PTR(-ENOMEM) if there is not enough memory.
+ */
+static page_node *write_page_node(asgn1_dev *dev, page_node *curr) {
+  curr = cow_page_node(dev, curr);
+  if (IS_ERR(curr)) return curr;
+  return own_page_node(dev, curr) ?: ERR_PTR(-ENOMEM);
+}
+
+
+/**
+ * This function decompresses or unshares page number index for a caller
+ * holding no lock, and for a writer copies it for a snapshot as well.
+ * Returns -ENOSPC if the copy would go over the limit, or -ENOMEM if there
+ * is not enough memory.
+ */
+static int own_page(asgn1_dev *dev, unsigned long index, bool write) {
+  page_node *curr;
+  page_range range;
+  int result = 0;
+
+  down_read(&dev->sem);
+  lock_page_range(dev, &range, (loff_t)index << PAGE_SHIFT, PAGE_SIZE, true);
+  /* Someone else may have done it or freed the page meanwhile */
+  curr = xa_load(dev_pages(dev), index);
+  if (curr && write) curr = write_page_node(dev, curr);
+  else if (curr) curr = own_page_node(dev, curr) ?: ERR_PTR(-ENOMEM);
+  if (IS_ERR(curr)) result = PTR_ERR(curr);
+  unlock_page_range(dev, &range);
+  up_read(&dev->sem);
+  return result;
+}
+
+
+/**
+ * Waits until the pages up to last have been restored from the backing
+ * file, if they are still being restored. ULONG_MAX waits for the whole
+ * restore. The caller must not hold dev->sem, which the restore needs.
+ */
+static inline void wait_restored(asgn1_dev *dev, unsigned long last) {
+  if (likely(!READ_ONCE(dev->restoring))) return;
+  wait_event(dev->restore_wait, !READ_ONCE(dev->restoring) ||
+      (last != ULONG_MAX && READ_ONCE(dev->restored) > last));
+}
+
+
+/**
+ * Looks up page number index without taking any lock, and returns its page
+ * with a reference held, or NULL for a hole. The caller drops the reference
+ * with put_page(). If nr is given, it is set to the number of pages from
+ * index to the end of the extent, which follow the returned page in memory.
+ * A compressed page is decompressed first, ERR_PTR(-ENOMEM) is returned if
+ * there is not enough memory to do so.
+ */
+static struct page *get_ramdisk_page(asgn1_dev *dev, unsigned long index,
+    unsigned long *nr) {
+  page_node *curr;
+  struct page *page;
+
+  wait_restored(dev, index);
+  rcu_read_lock();
+repeat:
+  curr = xa_load(dev_pages(dev), index);
+  if (curr == NULL) {
+    rcu_read_unlock();
+    return NULL;
+  }
+  if (curr->page == NULL) {
+    rcu_read_unlock();
+    if (own_page(dev, index, false)) return ERR_PTR(-ENOMEM);
+    rcu_read_lock();
+    goto repeat;
+  }
+  /* The node can't be freed, and its page can't be put, before the grace
+   * period ends */
+  page = nth_page(curr->page, index - curr->index);
+  get_page(page);
+  /* Don't hand out a page which was taken out of the index meanwhile */
+  if (unlikely(xa_load(dev_pages(dev), index) != curr)) {
+    put_page(page);
+    goto repeat;
+  }
+  if (nr) *nr = curr->index + (1UL << curr->order) - index;
+  /* Only dirty the node's cache line the first time round */
+  if (!READ_ONCE(curr->referenced)) WRITE_ONCE(curr->referenced, true);
+  rcu_read_unlock();
+  if (asgn1_comp_tfm) percpu_counter_inc(&dev->comp_hits);
+  return page;
+}
+
+
+/**
+ * Adds range to the locked ranges of the device unless it conflicts with
+ * one that is already held. Returns whether the range was locked.
+ */
+static bool try_lock_page_range(asgn1_dev *dev, page_range *range) {
+  page_range *held;
+
+  spin_lock(&dev->range_lock);
+  list_for_each_entry(held, &dev->ranges, list) {
+    if (held->first <= range->last && range->first <= held->last &&
+        (held->write || range->write)) {
+      spin_unlock(&dev->range_lock);
+      return false;
+    }
+  }
+  list_add(&range->list, &dev->ranges);
+  spin_unlock(&dev->range_lock);
+  return true;
+}
+
+
+/**
+ * This function locks the pages covering [offset, offset + len) for reading
+ * or writing, sleeping until no overlapping range conflicts with it. The
+ * caller must hold dev->sem for reading.
+ */
+static void lock_page_range(asgn1_dev *dev, page_range *range, loff_t offset,
+    size_t len, bool write) {
+  range->first = offset >> PAGE_SHIFT;
+  range->last = (offset + max_t(size_t, len, 1) - 1) >> PAGE_SHIFT;
+  range->write = write;
+  wait_event(dev->range_wait, try_lock_page_range(dev, range));
+}
+
+
+static void unlock_page_range(asgn1_dev *dev, page_range *range) {
+  spin_lock(&dev->range_lock);
+  list_del(&range->list);
+  spin_unlock(&dev->range_lock);
+  wake_up_all(&dev->range_wait);
+}
+
+
+/**
+ * This function moves the end of the ramdisk out to end, unless it is
+ * already past it.
+ */
+static void grow_data_size(asgn1_dev *dev, size_t end) {
+  spin_lock(&dev->size_lock);
+  if (end > dev->data_size) dev->data_size = end;
+  spin_unlock(&dev->size_lock);
+}
+
+
+/**
+ * This function zeroes len bytes of the ramdisk starting at offset, which
+ * must all lie in the same extent. Nothing is done for a hole, a compressed
+ * or shared page, or one a snapshot needs, is made the ramdisk's own first.
+ */
+static int zero_page_range(asgn1_dev *dev, loff_t offset, size_t len) {
+  page_node *curr = xa_load(dev_pages(dev), offset >> PAGE_SHIFT);
+
+  if (curr == NULL) return 0;
+  curr = write_page_node(dev, curr);
+  if (IS_ERR(curr)) return PTR_ERR(curr);
+  memset(node_address(curr, offset), 0, len);
+  update_crcs(dev, curr, offset >> PAGE_SHIFT, (offset + len - 1) >> PAGE_SHIFT);
+  return 0;
+}
+
+
+/**
+ * This function turns [offset, offset + len) into a hole. Pages lying
+ * wholly inside the range are freed and the partial pages at either end
+ * are zeroed. An extent is only freed if all of it lies in the range, the
+ * pages of any other extent inside the range are zeroed instead. The size
+ * of the ramdisk is left unchanged.
+ */
+static int punch_hole(asgn1_dev *dev, loff_t offset, loff_t len) {
+  loff_t end;
+  unsigned long first;  /* first page wholly inside the range */
+  unsigned long last;   /* page following the last one wholly inside */
+  unsigned long index;
+  unsigned long pos;
+  page_node *curr;
+  page_range range;
+  int result = 0;
+
+  if (offset < 0 || len <= 0) return -EINVAL;
+
+  wait_restored(dev, (offset + len - 1) >> PAGE_SHIFT);
+  down_read(&dev->sem);
+  if (offset >= dev->data_size) goto out;
+  end = min_t(loff_t, offset + len, dev->data_size);
+  lock_page_range(dev, &range, offset, end - offset, true);
+
+  first = DIV_ROUND_UP(offset, PAGE_SIZE);
+  last = end >> PAGE_SHIFT;
+
+  /* The range starts and ends inside a single page */
+  if (first > last) {
+    result = zero_page_range(dev, offset, end - offset);
+    goto out_unlock;
+  }
+  if (offset % PAGE_SIZE)
+    result = zero_page_range(dev, offset, PAGE_SIZE - offset % PAGE_SIZE);
+  if (end % PAGE_SIZE && end < dev->data_size)
+    result = zero_page_range(dev, end & PAGE_MASK, end % PAGE_SIZE) ?: result;
+  else if (end % PAGE_SIZE)
+    last++;  /* the tail of the final page holds no data */
+
+  if (first < last) {
+    zap_mappings(dev, first, last - 1);
+    xa_for_each_range(dev_pages(dev), index, curr, first, last - 1) {
+      if (curr->index < first ||
+          curr->index + (1UL << curr->order) > last) {
+        pos = max(curr->index, first);
+        result = zero_page_range(dev, (loff_t)pos << PAGE_SHIFT,
+            (min(curr->index + (1UL << curr->order), last) - pos) << PAGE_SHIFT) ?: result;
+        continue;
+      }
+      xa_erase(dev_pages(dev), curr->index);
+      drop_page_node(dev, curr);
+    }
+    forget_crcs(dev, first, last - 1);
+    zap_mappings(dev, first, last - 1);
+  }
+
+out_unlock:
+  unlock_page_range(dev, &range);
+out:
+  up_read(&dev->sem);
+  return result;
+}
+
+
+/**
+ * Returns the size class of a value of len bytes, or -1 if it is given
+ * pages of its own.
+ */
+static inline int kv_class(size_t len) {
+  if (len > PAGE_SIZE / 2) return -1;
+  if (len <= 1 << KV_MIN_SHIFT) return 0;
+  return order_base_2(len) - KV_MIN_SHIFT;
+}
+
+
+/**
+ * Finds a place in the ramdisk for a value of len bytes, with kv_sem held.
+ * A value of a size class takes a free slot of it, or else a new page is
+ * carved into slots. Returns the offset of the place, or an error.
+ */
+static loff_t kv_alloc(asgn1_dev *dev, size_t len) {
+  int class = kv_class(len);
+  size_t size = (class < 0) ? round_up(len, PAGE_SIZE) : PAGE_SIZE;
+  size_t slot;
+  unsigned long index = 0;
+  loff_t offset;
+  loff_t pos;
+
+  mutex_lock(&dev->kv_alloc_lock);
+  if (class >= 0 &&
+      xa_find(&dev->kv_free[class], &index, ULONG_MAX, XA_PRESENT)) {
+    xa_erase(&dev->kv_free[class], index);
+    offset = (loff_t)index << KV_MIN_SHIFT;
+    goto out;
+  }
+  if (dev->kv_end > MAX_LFS_FILESIZE - size) {
+    offset = -ENOSPC;
+    goto out;
+  }
+  offset = dev->kv_end;
+  dev->kv_end += size;
+
+  /* The rest of a new page is left as free slots. One which can't be
+   * recorded is only lost until the next reset */
+  if (class >= 0) {
+    slot = (size_t)1 << (class + KV_MIN_SHIFT);
+    for (pos = offset + slot; pos < offset + PAGE_SIZE; pos += slot)
+      xa_store(&dev->kv_free[class], pos >> KV_MIN_SHIFT, xa_mk_value(0),
+          GFP_KERNEL);
+  }
+out:
+  mutex_unlock(&dev->kv_alloc_lock);
+  return offset;
+}
+
+
+/**
+ * Gives back the place kv_alloc found for a value of len bytes, with
+ * kv_sem held. Pages of its own are freed straight away, their offsets are
+ * not used again until the next reset.
+ */
+static void kv_release(asgn1_dev *dev, loff_t offset, size_t len) {
+  int class = kv_class(len);
+
+  if (class < 0) {
+    punch_hole(dev, offset, round_up(len, PAGE_SIZE));
+    return;
+  }
+  mutex_lock(&dev->kv_alloc_lock);
+  xa_store(&dev->kv_free[class], offset >> KV_MIN_SHIFT, xa_mk_value(0),
+      GFP_KERNEL);
+  mutex_unlock(&dev->kv_alloc_lock);
+}
+
+
+/**
+ * Looks up a key with kv_sem held, hash being xxh64 of it.
+ */
+static kv_entry *kv_lookup(asgn1_dev *dev, const char *key, u32 key_len,
+    u64 hash) {
+  kv_entry *entry;
+
+  hash_for_each_possible(dev->kv_hash, entry, hash, hash) {
+    if (entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+
+/**
+ * Forgets every key and free slot, with kv_sem held for writing. The pages
+ * of the values are left to be dropped by the caller.
+ */
+static void kv_forget(asgn1_dev *dev) {
+  kv_entry *entry;
+  struct hlist_node *tmp;
+  int bkt;
+  int class;
+
+  hash_for_each_safe(dev->kv_hash, bkt, tmp, entry, hash) {
+    hash_del(&entry->hash);
+    kfree(entry);
+  }
+  xa_destroy(&dev->kv_ids);
+  for (class = 0; class < KV_CLASSES; class++)
+    xa_destroy(&dev->kv_free[class]);
+  dev->kv_end = 0;
+  dev->kv_gen++;
+}
+
+
+/**
+ * Empties the device, for a reset or, with truncate set, an O_TRUNC open.
+ * Its pages are freed in the background, TEM_FLUSH_FREE waits for that.
+ * A key-value store loses its keys too.
+ */
+static void drop_all_pages(asgn1_dev *dev, bool truncate) {
+  u64 start = ktime_get_ns();
+  size_t data_size;
+  unsigned long pages;
+
+  if (kv) {
+    down_write(&dev->kv_sem);
+    kv_forget(dev);
+  }
+  down_write(&dev->sem);
+  data_size = dev->data_size;
+  pages = atomic_long_read(&dev->num_pages);
+  detach_memory_pages(dev);
+  up_write(&dev->sem);
+  if (kv) up_write(&dev->kv_sem);
+
+  if (truncate)
+    trace_asgn1_truncate(dev->dev, 0, data_size, pages, 0,
+        ktime_get_ns() - start);
+  else
+    trace_asgn1_reset(dev->dev, 0, data_size, pages, 0, ktime_get_ns() - start);
+}
+
+
+/**
+ * This function opens the virtual disk, if it is opened in the write-only
+ * mode, all memory pages will be freed.
+ */
+int asgn1_open(struct inode *inode, struct file *filp) {
+  asgn1_dev *dev;
+  u64 start = ktime_get_ns();
+
+  if (iminor(inode) - asgn1_minor >= asgn1_dev_count) return -ENODEV;
+  dev = &asgn1_devices[iminor(inode) - asgn1_minor];
+  filp->private_data = dev;
+
+  /* Increment the process count and check it's not greater than
+   * the maximum allowed procs. If it is then decrement it back
+   * to what it was and return EBUSY. */
+  atomic_inc(&dev->nprocs);
+  if (atomic_read(&dev->nprocs) >
+      atomic_read(&dev->max_nprocs)) {
+    atomic_dec(&dev->nprocs);
+    this_cpu_inc(dev->stats->open_busy);
+    trace_asgn1_open(dev->dev, filp->f_pos, 0, 0, -EBUSY,
+        ktime_get_ns() - start);
+    return -EBUSY;
+  }
+
+  /* Share one address_space between every open file, so mappings of the
+   * ramdisk can be found again when their pages are freed. That of the
+   * device inode can't be used, as its pages aren't in a page cache */
+  mutex_lock(&asgn1_inode_lock);
+  if (dev->inode == NULL) {
+    dev->inode = igrab(inode);
+    dev->mapping.host = dev->inode;
+  }
+  if (dev->inode) filp->f_mapping = &dev->mapping;
+  mutex_unlock(&asgn1_inode_lock);
+
+  if (filp->f_flags & O_APPEND) filp->f_pos = dev->data_size;
+
+  /* Only truncate the file if it is opened for writing, and is expected
+   * to be truncated */
+  if (filp->f_flags & O_TRUNC &&
+      filp->f_flags & O_WRONLY)
+    drop_all_pages(dev, true);
+
+  trace_asgn1_open(dev->dev, filp->f_pos, 0, 0, 0, ktime_get_ns() - start);
+  return 0; /* success */
+}
+
+
+/**
+ * This function releases the virtual disk, but nothing needs to be done
+ * in this case. 
+ */
+int asgn1_release (struct inode *inode, struct file *filp) {
+  asgn1_dev *dev = filp->private_data;
+  u64 start = ktime_get_ns();
+
+  if (atomic_read(&dev->nprocs) > 0)
+    atomic_dec(&dev->nprocs);
+  trace_asgn1_release(dev->dev, filp->f_pos, 0, 0, 0, ktime_get_ns() - start);
+  return 0;
+}
+
+
+/**
+ * This function reads contents of the virtual disk at *pos into an iov_iter.
+ * Readers take no locks at all. Each page is looked up under RCU and pinned
+ * with a reference while it is copied, so a concurrent reset or hole punch
+ * can't free it underneath the copy. A read racing with a write to the same
+ * bytes may see part of the write, as with a regular file.
+ */
+static ssize_t asgn1_do_read(asgn1_dev *dev, loff_t *pos, struct iov_iter *to) {
+  size_t count = iov_iter_count(to);
+  size_t size_read = 0;     /* size read from virtual disk in this function */
+  size_t begin_offset;      /* the offset from the beginning of a page to
+                               start reading */
+  size_t curr_size_read;    /* size read from the virtual disk in this round */
+  size_t size_to_be_read;   /* size to be read in the current round in 
+                               while loop */
+  size_t data_size = READ_ONCE(dev->data_size);
+  unsigned long nr;         /* pages left in the extent being read */
+
+  struct page *page = NULL;
+
+  if (*pos >= data_size) return 0;
+  if (*pos + count > data_size) count = data_size-*pos;
+
+  /* Only the pages covering [*pos, *pos + count) are looked up, straight
+   * from the page index */
+  while (size_read < count) {
+    page = get_ramdisk_page(dev, *pos >> PAGE_SHIFT, &nr);
+    if (IS_ERR(page)) break;
+    if (page == NULL) nr = 1;
+
+    /* The rest of an extent is copied in one go, without another lookup */
+    begin_offset = *pos % PAGE_SIZE;
+    size_to_be_read = min((long)count - size_read, (long)(nr * PAGE_SIZE) - begin_offset);
+
+    /* A hole reads back as zeros without allocating anything */
+    if (page == NULL) {
+      curr_size_read = iov_iter_zero(size_to_be_read, to);
+    } else {
+      curr_size_read = copy_to_iter(page_address(page) + begin_offset,
+          size_to_be_read, to);
+      put_page(page);
+    }
+
+    /* Update the file position and the total amount read. If the copy was
+     * not successful then break out of the loop to prevent any more reads.
+     * The user can recall the read function to complete it. */
+    *pos += curr_size_read;
+    size_read += curr_size_read;
+
+    /* If we didn't read all we wanted to this iteration, stop reading and
+     * return what we have read so far. */
+    if (curr_size_read < size_to_be_read) break;
+  }
+  //printk(KERN_WARNING "%s: %d bytes read\n", MYDEV_NAME, size_read);
+  /* If the read function wasn't able to read anything then return an error */
+  if (size_read == 0 && IS_ERR(page)) return PTR_ERR(page);
+  return (size_read > 0) ? size_read : -EFAULT;
+}
+
+
+/**
+ * Pipe buffers handed out by asgn1_splice_read. They hold a reference to
+ * a page of the ramdisk, which can't be stolen as it is still in use.
+ */
+static const struct pipe_buf_operations asgn1_pipe_buf_ops = {
+  .release = generic_pipe_buf_release,
+  .get = generic_pipe_buf_get,
+};
+
+
+/**
+ * This function splices the ramdisk into a pipe without copying it. Each pipe
+ * buffer holds a reference to the ramdisk page itself, and holes are served
+ * from the zero page, so sendfile() from the ramdisk to a socket never goes
+ * through a bounce buffer. Later writes to the ramdisk show through pages
+ * still sitting in the pipe, as with vmsplice().
+ */
+static ssize_t asgn1_splice_read(struct file *in, loff_t *ppos,
+    struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+  asgn1_dev *dev = in->private_data;
+  size_t data_size = READ_ONCE(dev->data_size);
+  u64 start = ktime_get_ns();
+  loff_t pos = *ppos;
+  ssize_t spliced = 0;
+  ssize_t result;
+  struct pipe_buffer buf;
+  struct page *page;
+
+  if (*ppos >= data_size) return 0;
+  len = min_t(size_t, len, data_size - *ppos);
+
+  while (len) {
+    page = get_ramdisk_page(dev, *ppos >> PAGE_SHIFT, NULL);
+    if (IS_ERR(page)) {
+      if (spliced == 0) spliced = PTR_ERR(page);
+      break;
+    }
+    if (page == NULL) {
+      page = ZERO_PAGE(0);
+      get_page(page);
+    }
+
+    buf = (struct pipe_buffer) {
+      .page = page,
+      .offset = *ppos % PAGE_SIZE,
+      .len = min_t(size_t, len, PAGE_SIZE - *ppos % PAGE_SIZE),
+      .ops = &asgn1_pipe_buf_ops,
+    };
+    /* add_to_pipe drops the reference itself if the pipe is full */
+    result = add_to_pipe(pipe, &buf);
+    if (result < 0) {
+      if (spliced == 0) spliced = result;
+      break;
+    }
+
+    *ppos += result;
+    spliced += result;
+    len -= result;
+  }
+  account_io(dev, false, pos, *ppos - pos + len, spliced, start);
+  return spliced;
+}
+
+
+/**
+ * This function finds the start of the data or the hole at or after offset,
+ * for SEEK_DATA and SEEK_HOLE respectively. The end of the ramdisk counts
+ * as a hole.
+ */
+static loff_t seek_data_hole(asgn1_dev *dev, loff_t offset, int cmd) {
+  unsigned long index = offset >> PAGE_SHIFT;
+  unsigned long last = (dev->data_size - 1) >> PAGE_SHIFT;
+  page_node *curr;
+  XA_STATE(xas, dev_pages(dev), index);
+
+  if (cmd == SEEK_DATA) {
+    if (xa_find(dev_pages(dev), &index, last, XA_PRESENT) == NULL)
+      return -ENXIO;
+    return max_t(loff_t, offset, (loff_t)index << PAGE_SHIFT);
+  }
+
+  /* Walk the run of present extents starting at offset until a gap shows
+   * up */
+  rcu_read_lock();
+  xas_for_each(&xas, curr, last) {
+    if (xas_retry(&xas, curr)) continue;
+    if (curr->index > index) break;
+    index = curr->index + (1UL << curr->order);
+  }
+  rcu_read_unlock();
+  return min_t(loff_t, max_t(loff_t, offset, (loff_t)index << PAGE_SHIFT),
+      dev->data_size);
+}
+
+
+/**
+ * This function repositions the offset of the open file associated with the 
+ * file descriptor fd. Seeking past the end is allowed, a write there leaves
+ * a hole behind. */
+static loff_t asgn1_lseek (struct file *file, loff_t offset, int cmd)
+{
+  asgn1_dev *dev = file->private_data;
+  u64 start = ktime_get_ns();
+  loff_t testpos;
+
+  switch (cmd) {
+    case SEEK_SET:
+      testpos = offset;
+      break;
+    case SEEK_CUR:
+      testpos = file->f_pos + offset;
+      break;
+    case SEEK_END:
+      testpos = dev->data_size + offset;
+      break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+      wait_restored(dev, ULONG_MAX);
+      down_read(&dev->sem);
+      if (offset < 0 || offset >= dev->data_size) testpos = -ENXIO;
+      else testpos = seek_data_hole(dev, offset, cmd);
+      up_read(&dev->sem);
+      if (testpos < 0) goto out;
+      break;
+    default:
+      printk(KERN_WARNING "%s: Invalid cmd given to asgn1_lseek.\n", MYDEV_NAME);
+      testpos = -EINVAL;
+      goto out;
+  }
+
+  if (testpos < 0) testpos = 0;
+  else if (testpos > MAX_LFS_FILESIZE) testpos = MAX_LFS_FILESIZE;
+
+  file->f_pos = testpos;
+out:
+  trace_asgn1_lseek(dev->dev, offset, 0, 0, testpos, ktime_get_ns() - start);
+  return testpos;
+}
+
+
+/**
+ * This function writes up to count bytes from an iov_iter to the pages at
+ * *pos, allocating just the ones which are written to. Anything skipped
+ * over stays a hole. The caller must hold dev->sem for reading and the
+ * pages locked for writing. The user buffer may be a mapping of this
+ * ramdisk, whose fault handler can need dev->sem, so it is not faulted in:
+ * the write stops short where the buffer is not in memory, and -EFAULT is
+ * returned if nothing could be written because of it.
+ */
+static ssize_t write_locked(asgn1_dev *dev, loff_t *pos,
+    struct iov_iter *from, size_t count) {
+  size_t size_written = 0;  /* size written to virtual disk in this function */
+  size_t curr_size_written; /* size written to virtual disk in this round */
+  size_t size_to_be_written;  /* size to be read in the current round in 
+                                 while loop */
+  ssize_t result = -EFAULT; /* returned if nothing could be written */
+
+  page_node *curr;
+
+  while (size_written < count) {
+    curr = xa_load(dev_pages(dev), *pos >> PAGE_SHIFT);
+    if (curr == NULL) curr = alloc_page_node(dev, *pos >> PAGE_SHIFT);
+    if (!IS_ERR(curr)) curr = write_page_node(dev, curr);
+    if (IS_ERR(curr)) {
+      result = PTR_ERR(curr);
+      if (result == -ENOMEM)
+        printk(KERN_WARNING "%s: Not enough memory to allocate anymore pages\n", MYDEV_NAME);
+      break;
+    }
+    if (!READ_ONCE(curr->referenced)) WRITE_ONCE(curr->referenced, true);
+    unreserve_page_node(dev, curr);
+    /* Make sure the size we are about to write fits within the extent */
+    size_to_be_written = min((long) count - size_written,
+        (long) node_bytes_left(curr, *pos));
+
+    pagefault_disable();
+    curr_size_written = copy_from_iter(node_address(curr, *pos),
+        size_to_be_written, from);
+    pagefault_enable();
+    if (curr_size_written)
+      update_crcs(dev, curr, *pos >> PAGE_SHIFT,
+          (*pos + curr_size_written - 1) >> PAGE_SHIFT);
+
+    /* Update the file position and the total amount written */
+    *pos += curr_size_written;
+    size_written += curr_size_written;
+    if (curr_size_written < size_to_be_written) break;
+  }
+
+  grow_data_size(dev, *pos);
+  return (size_written > 0) ? size_written : result;
+}
+
+
+/**
+ * This function writes from an iov_iter to the virtual disk of this module
+ * at *pos. Writers lock only the pages they write to, so writers of
+ * separate parts of the ramdisk don't wait for each other.
+ */
+static ssize_t asgn1_do_write(asgn1_dev *dev, loff_t *pos,
+    struct iov_iter *from) {
+  size_t count = iov_iter_count(from);
+  size_t size_written = 0;  /* size written to virtual disk in this function */
+  size_t size_not_written;
+  ssize_t result;
+
+  page_range range;
+
+  wait_restored(dev, (*pos + count - 1) >> PAGE_SHIFT);
+  down_read(&dev->sem);
+  lock_page_range(dev, &range, *pos, count, true);
+
+  while (size_written < count) {
+    result = write_locked(dev, pos, from, count - size_written);
+    if (result > 0) {
+      size_written += result;
+      continue;
+    }
+    if (result != -EFAULT) break;
+
+    /* If the copy was not successful, fault the buffer in with the locks
+     * dropped and carry on. If it can't be faulted in, stop writing; the
+     * user can recall the write function to complete it. */
+    size_not_written = min_t(size_t, count - size_written,
+        PAGE_SIZE - *pos % PAGE_SIZE);
+    unlock_page_range(dev, &range);
+    up_read(&dev->sem);
+    if (fault_in_iov_iter_readable(from, size_not_written) ==
+        size_not_written)
+      goto out;
+    down_read(&dev->sem);
+    lock_page_range(dev, &range, *pos, count - size_written, true);
+  }
+  unlock_page_range(dev, &range);
+  up_read(&dev->sem);
+
+out:
+  //printk(KERN_INFO "%s: %d bytes written\n", MYDEV_NAME, size_written);
+  /* If the write function wasn't able to write anything then return an error */
+  return (size_written > 0) ? size_written : result;
+}
+
+
+/**
+ * This function writes from the user buffer to the virtual disk, for
+ * write() and writev() alike. Splicing into the ramdisk goes through here
+ * too, by iter_file_splice_write.
+ */
+static ssize_t asgn1_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+  asgn1_dev *dev = iocb->ki_filp->private_data;
+  u64 start = ktime_get_ns();
+  loff_t pos = iocb->ki_pos;
+  size_t count = iov_iter_count(from);
+  ssize_t result;
+
+  /* A key-value store is only written by TEM_KV_PUT */
+  if (kv) return -EPERM;
+  if (count == 0) return 0;
+  result = asgn1_do_write(dev, &iocb->ki_pos, from);
+  account_io(dev, true, pos, count, result, start);
+  return result;
+}
+
+/**
+ * This function preallocates the pages of [offset, offset + len), so that
+ * writing to them later doesn't allocate anything. With zero set, pages
+ * already holding data in the range are zeroed too. Unless keep_size is
+ * set, the size of the ramdisk grows to cover the range.
+ */
+static int reserve_range(asgn1_dev *dev, loff_t offset, loff_t len, bool zero,
+    bool keep_size) {
+  loff_t end;
+  loff_t from, to;          /* part of the range inside the current extent */
+  unsigned long index;
+  unsigned long next;       /* page following the current extent */
+  page_node *curr;
+  page_range range;
+  int result = 0;
+
+  if (offset < 0 || len <= 0) return -EINVAL;
+  if (len > MAX_LFS_FILESIZE - offset) return -EFBIG;
+  end = offset + len;
+
+  wait_restored(dev, (end - 1) >> PAGE_SHIFT);
+  down_read(&dev->sem);
+  lock_page_range(dev, &range, offset, len, true);
+
+  for (index = offset >> PAGE_SHIFT; index <= (end - 1) >> PAGE_SHIFT;
+      index = next) {
+    curr = xa_load(dev_pages(dev), index);
+    if (curr == NULL) {
+      curr = alloc_page_node(dev, index);
+      if (IS_ERR(curr)) {
+        result = PTR_ERR(curr);
+        break;
+      }
+      if (!test_and_set_bit(NODE_RESERVED, &curr->flags))
+        atomic_long_add(1UL << curr->order, &dev->reserved_pages);
+      next = curr->index + (1UL << curr->order);
+    } else {
+      /* Zeroing may replace the node, so it isn't looked at afterwards */
+      next = curr->index + (1UL << curr->order);
+      from = max_t(loff_t, offset, (loff_t)curr->index << PAGE_SHIFT);
+      to = min_t(loff_t, end, (loff_t)next << PAGE_SHIFT);
+      if (zero) result = zero_page_range(dev, from, to - from);
+      if (result < 0) break;
+    }
+    cond_resched();
+  }
+
+  unlock_page_range(dev, &range);
+  up_read(&dev->sem);
+  if (result == 0 && !keep_size) grow_data_size(dev, end);
+  return result;
+}
+
+
+/**
+ * This function preallocates pages through fallocate() with a mode of 0 or
+ * FALLOC_FL_ZERO_RANGE, and punches a hole with FALLOC_FL_PUNCH_HOLE. The
+ * VFS only passes fallocate on to regular files and block devices, so for
+ * the character device TEM_RESERVE and TEM_PUNCH_HOLE do the same.
+ */
+static long asgn1_fallocate(struct file *filp, int mode, loff_t offset,
+    loff_t len) {
+  asgn1_dev *dev = filp->private_data;
+  bool keep_size = mode & FALLOC_FL_KEEP_SIZE;
+
+  if (kv) return -EPERM;
+  switch (mode & ~FALLOC_FL_KEEP_SIZE) {
+    case 0:
+      return reserve_range(dev, offset, len, false, keep_size);
+    case FALLOC_FL_ZERO_RANGE:
+      return reserve_range(dev, offset, len, true, keep_size);
+    case FALLOC_FL_PUNCH_HOLE:
+      if (!keep_size) return -EOPNOTSUPP;
+      return punch_hole(dev, offset, len);
+    default:
+      return -EOPNOTSUPP;
+  }
+}
+
+
+/**
+ * The backing file starts with a header, followed by runs of pages. Each
+ * run is a run header followed by the contents of count consecutive pages,
+ * and a run with a count of 0 ends the file. Holes take no space.
+ */
+#define IMAGE_MAGIC "ASGN1IMG"
+#define IMAGE_VERSION 1
+#define IMAGE_BATCH 256           /* pages moved per file read or write */
+
+struct asgn1_image_header {
+  char magic[8];
+  __le32 version;
+  __le32 page_size;
+  __le64 data_size;
+};
+
+struct asgn1_image_run {
+  __le64 index;                   /* page number of the first page */
+  __le64 count;                   /* number of pages in the run */
+};
+
+
+/**
+ * Opens the backing file of ramdisk dev.
+ */
+static struct file *open_backing_file(asgn1_dev *dev, int flags) {
+  struct file *file;
+  char *path;
+
+  path = kasprintf(GFP_KERNEL, "%s.%td", backing_file, dev - asgn1_devices);
+  if (path == NULL) return ERR_PTR(-ENOMEM);
+  file = filp_open(path, flags | O_LARGEFILE, 0600);
+  kfree(path);
+  return file;
+}
+
+
+/**
+ * Writes a run of n pages starting at page number index to the backing
+ * file with a single write.
+ */
+static int write_image_run(struct file *file, loff_t *pos, unsigned long index,
+    struct bio_vec *bv, unsigned int n) {
+  struct asgn1_image_run run = {
+    .index = cpu_to_le64(index),
+    .count = cpu_to_le64(n),
+  };
+  struct iov_iter iter;
+  ssize_t result;
+
+  result = kernel_write(file, &run, sizeof(run), pos);
+  if (result != sizeof(run)) return result < 0 ? result : -EIO;
+  if (n == 0) return 0;
+  iov_iter_bvec(&iter, ITER_SOURCE, bv, n, (size_t)n << PAGE_SHIFT);
+  result = vfs_iter_write(file, &iter, pos, 0);
+  if (result != (ssize_t)n << PAGE_SHIFT) return result < 0 ? result : -EIO;
+  return 0;
+}
+
+
+/**
+ * This function saves the contents of the ramdisk to its backing file.
+ * Writers are kept out meanwhile, so the image is a consistent snapshot of
+ * everything but stores through shared mappings.
+ */
+static int save_ramdisk(asgn1_dev *dev) {
+  struct asgn1_image_header header = {
+    .magic = IMAGE_MAGIC,
+    .version = cpu_to_le32(IMAGE_VERSION),
+    .page_size = cpu_to_le32(PAGE_SIZE),
+  };
+  struct bio_vec *bv;
+  struct page **tmp;          /* decompressed copies in the batch */
+  unsigned int n = 0, ntmp = 0;
+  unsigned long first = 0;    /* page number of bv[0] */
+  unsigned long index, i;
+  page_node *curr;
+  struct file *file;
+  loff_t pos = 0;
+  ssize_t written;
+  int result = 0;
+
+  if (backing_file == NULL || *backing_file == '\0') return -EINVAL;
+  wait_restored(dev, ULONG_MAX);
+
+  bv = kmalloc_array(IMAGE_BATCH, sizeof(*bv), GFP_KERNEL);
+  tmp = kmalloc_array(IMAGE_BATCH, sizeof(*tmp), GFP_KERNEL);
+  if (bv == NULL || tmp == NULL) {
+    result = -ENOMEM;
+    goto out_free;
+  }
+  file = open_backing_file(dev, O_WRONLY | O_CREAT | O_TRUNC);
+  if (IS_ERR(file)) {
+    result = PTR_ERR(file);
+    goto out_free;
+  }
+
+  down_write(&dev->sem);
+  header.data_size = cpu_to_le64(dev->data_size);
+  written = kernel_write(file, &header, sizeof(header), &pos);
+  if (written != sizeof(header)) {
+    result = written < 0 ? written : -EIO;
+    goto out_unlock;
+  }
+
+  /* Consecutive pages are gathered into runs, extents only show up once */
+  xa_for_each(dev_pages(dev), index, curr) {
+    for (i = curr->index; i < curr->index + (1UL << curr->order); i++) {
+      if (n && (first + n != i || n == IMAGE_BATCH)) {
+        result = write_image_run(file, &pos, first, bv, n);
+        while (ntmp) __free_page(tmp[--ntmp]);
+        n = 0;
+        if (result < 0) goto out_unlock;
+      }
+      if (n == 0) first = i;
+
+      if (curr->page) {
+        bvec_set_page(&bv[n++], nth_page(curr->page, i - curr->index),
+            PAGE_SIZE, 0);
+        continue;
+      }
+      tmp[ntmp] = alloc_page(GFP_KERNEL);
+      if (tmp[ntmp] == NULL) {
+        result = -ENOMEM;
+        goto out_unlock;
+      }
+      result = decompress_page(curr, tmp[ntmp]);
+      if (result < 0) {
+        __free_page(tmp[ntmp]);
+        goto out_unlock;
+      }
+      bvec_set_page(&bv[n++], tmp[ntmp++], PAGE_SIZE, 0);
+    }
+    cond_resched();
+  }
+  if (n) result = write_image_run(file, &pos, first, bv, n);
+  if (result == 0) result = write_image_run(file, &pos, 0, NULL, 0);
+
+out_unlock:
+  up_write(&dev->sem);
+  while (ntmp) __free_page(tmp[--ntmp]);
+  if (result == 0) result = vfs_fsync(file, 0);
+  filp_close(file, NULL);
+  if (result < 0)
+    printk(KERN_WARNING "%s: Couldn't save ramdisk %td (%d)\n", MYDEV_NAME,
+        dev - asgn1_devices, result);
+out_free:
+  kfree(tmp);
+  kfree(bv);
+  return result;
+}
+
+
+/**
+ * Inserts the n freshly read pages starting at page number index into the
+ * page index, unless the ramdisk was reset meanwhile. Pages which already
+ * hold data are kept. The pages are charged against max_bytes like any
+ * others. Returns 0, -ECANCELED if the ramdisk was reset, -ENOSPC if the
+ * pages would take it over max_bytes or -ENOMEM.
+ */
+static int insert_restored_pages(asgn1_dev *dev, unsigned long index,
+    struct page **pages, unsigned int n) {
+  page_node *curr;
+  unsigned int i;
+  unsigned int stored = 0;
+  int result = 0;
+
+  down_read(&dev->sem);
+  if (!dev->restoring) {
+    result = -ECANCELED;
+    goto out;
+  }
+  if (!charge_pages(dev, n)) {
+    result = -ENOSPC;
+    goto out;
+  }
+  for (i = 0; i < n; i++) {
+    curr = new_page_node(dev, GFP_KERNEL);
+    if (curr == NULL) {
+      result = -ENOMEM;
+      break;
+    }
+    curr->page = pages[i];
+    curr->index = index + i;
+    curr->order = 0;
+    curr->referenced = false;
+    curr->zdata = NULL;
+    curr->zlen = 0;
+    curr->shared = NULL;
+    curr->flags = 0;
+    curr->gen = dev->generation;
+    if (store_page_node(dev, curr) < 0) {
+      kfree(curr);
+      continue;
+    }
+    update_crcs(dev, curr, curr->index, curr->index);
+    pages[i] = NULL;
+    stored++;
+  }
+  atomic_long_sub(n - stored, &dev->num_pages);
+  /* Pages before the end of this batch are done, holes included */
+  WRITE_ONCE(dev->restored, index + n);
+  wake_up_all(&dev->restore_wait);
+out:
+  up_read(&dev->sem);
+  return result;
+}
+
+
+/**
+ * The restore of a ramdisk from its backing file, run in the background
+ * once the module is loaded. Runs are read IMAGE_BATCH pages at a time in
+ * file order, which is page order, and anyone wanting a page further on
+ * waits in wait_restored until the restore gets there.
+ */
+static void asgn1_restore(struct work_struct *work) {
+  asgn1_dev *dev = container_of(work, asgn1_dev, restore_work);
+  struct asgn1_image_run run;
+  struct bio_vec *bv;
+  struct page **pages;
+  struct iov_iter iter;
+  unsigned long index;
+  u64 count;
+  unsigned int n, i;
+  ssize_t result = 0;
+
+  bv = kmalloc_array(IMAGE_BATCH, sizeof(*bv), GFP_KERNEL);
+  pages = kcalloc(IMAGE_BATCH, sizeof(*pages), GFP_KERNEL);
+  if (bv == NULL || pages == NULL) {
+    result = -ENOMEM;
+    goto out;
+  }
+
+  for (;;) {
+    result = kernel_read(dev->restore_file, &run, sizeof(run),
+        &dev->restore_pos);
+    if (result != sizeof(run)) goto out_short;
+    index = le64_to_cpu(run.index);
+    count = le64_to_cpu(run.count);
+    if (count == 0) break;
+    /* Runs must come in page order and stay inside the largest file */
+    if (index < dev->restored || count > MAX_LFS_FILESIZE >> PAGE_SHIFT ||
+        index > (MAX_LFS_FILESIZE >> PAGE_SHIFT) - count) {
+      result = -EINVAL;
+      goto out;
+    }
+
+    while (count) {
+      n = min_t(u64, count, IMAGE_BATCH);
+      for (i = 0; i < n; i++) {
+        pages[i] = asgn1_page_alloc(dev, GFP_KERNEL);
+        if (pages[i] == NULL) {
+          result = -ENOMEM;
+          goto out;
+        }
+        bvec_set_page(&bv[i], pages[i], PAGE_SIZE, 0);
+      }
+      iov_iter_bvec(&iter, ITER_DEST, bv, n, (size_t)n << PAGE_SHIFT);
+      result = vfs_iter_read(dev->restore_file, &iter, &dev->restore_pos, 0);
+      if (result != (ssize_t)n << PAGE_SHIFT) goto out_short;
+      result = insert_restored_pages(dev, index, pages, n);
+      if (result == -ECANCELED) {
+        result = 0;
+        goto out;
+      }
+      if (result < 0) goto out;
+      for (i = 0; i < n; i++) {
+        if (pages[i]) __free_page(pages[i]);
+        pages[i] = NULL;
+      }
+      index += n;
+      count -= n;
+      cond_resched();
+    }
+  }
+  result = 0;
+  goto out;
+
+out_short:
+  if (result >= 0) result = -EIO;
+out:
+  if (result == -ENOSPC)
+    printk(KERN_WARNING "%s: Ramdisk %td reached max_bytes, restore stopped\n",
+        MYDEV_NAME, dev - asgn1_devices);
+  else if (result < 0)
+    printk(KERN_WARNING "%s: Couldn't restore ramdisk %td (%zd)\n",
+        MYDEV_NAME, dev - asgn1_devices, result);
+  if (pages) {
+    for (i = 0; i < IMAGE_BATCH; i++)
+      if (pages[i]) __free_page(pages[i]);
+  }
+  kfree(pages);
+  kfree(bv);
+  fput(dev->restore_file);
+  dev->restore_file = NULL;
+  WRITE_ONCE(dev->restoring, false);
+  wake_up_all(&dev->restore_wait);
+}
+
+
+/**
+ * Starts restoring ramdisk dev from its backing file, if it has one. The
+ * size of the ramdisk is known from the start.
+ */
+static void start_restore(asgn1_dev *dev) {
+  struct asgn1_image_header header;
+  struct file *file;
+  ssize_t result;
+
+  if (backing_file == NULL || *backing_file == '\0') return;
+  file = open_backing_file(dev, O_RDONLY);
+  if (IS_ERR(file)) return;
+
+  result = kernel_read(file, &header, sizeof(header), &dev->restore_pos);
+  if (result != sizeof(header) ||
+      memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) ||
+      le32_to_cpu(header.version) != IMAGE_VERSION ||
+      le32_to_cpu(header.page_size) != PAGE_SIZE) {
+    printk(KERN_WARNING "%s: Backing file of ramdisk %td is not an image\n",
+        MYDEV_NAME, dev - asgn1_devices);
+    fput(file);
+    return;
+  }
+
+  dev->data_size = le64_to_cpu(header.data_size);
+  dev->restore_file = file;
+  dev->restored = 0;
+  dev->restoring = true;
+  queue_work(system_unbound_wq, &dev->restore_work);
+}
+
+
+/**
+ * This function reads from the pages at *pos into an iov_iter like
+ * asgn1_do_read, for callers already holding dev->sem for reading and the
+ * pages locked for writing. A compressed page is decompressed here rather
+ * than by own_page(), which would take dev->sem again. The buffer is not
+ * faulted in, as in write_locked().
+ */
+static ssize_t read_locked(asgn1_dev *dev, loff_t *pos, struct iov_iter *to) {
+  size_t count = iov_iter_count(to);
+  size_t data_size = READ_ONCE(dev->data_size);
+  size_t size_read = 0;     /* size read from virtual disk in this function */
+  size_t curr_size_read;    /* size read from the virtual disk in this round */
+  size_t size_to_be_read;   /* size to be read in the current round */
+  bool verify = READ_ONCE(dev->verify_reads);
+  page_node *curr;
+
+  if (*pos >= data_size) return 0;
+  if (*pos + count > data_size) count = data_size - *pos;
+
+  while (size_read < count) {
+    curr = xa_load(dev_pages(dev), *pos >> PAGE_SHIFT);
+    if (curr && curr->page == NULL) {
+      curr = decompress_page_node(dev, curr);
+      if (curr == NULL) return size_read ?: -ENOMEM;
+    }
+
+    /* With verify_reads, each page is checked before it is copied */
+    if (curr && verify &&
+        !check_crc(dev, nth_page(curr->page, (*pos >> PAGE_SHIFT) - curr->index),
+          *pos >> PAGE_SHIFT))
+      return size_read ?: -EIO;
+
+    pagefault_disable();
+    if (curr) {
+      size_to_be_read = min(count - size_read, node_bytes_left(curr, *pos));
+      if (verify)
+        size_to_be_read = min(size_to_be_read,
+            (size_t)(PAGE_SIZE - *pos % PAGE_SIZE));
+      curr_size_read = copy_to_iter(node_address(curr, *pos),
+          size_to_be_read, to);
+      if (!READ_ONCE(curr->referenced)) WRITE_ONCE(curr->referenced, true);
+    } else {
+      size_to_be_read = min(count - size_read,
+          (size_t)(PAGE_SIZE - *pos % PAGE_SIZE));
+      curr_size_read = iov_iter_zero(size_to_be_read, to);
+    }
+    pagefault_enable();
+
+    *pos += curr_size_read;
+    size_read += curr_size_read;
+    if (curr_size_read < size_to_be_read) break;
+  }
+  return (size_read > 0) ? size_read : -EFAULT;
+}
+
+
+/**
+ * This function reads or writes the whole of iter at *pos with dev->sem
+ * held for reading. Returns the bytes transferred, or an error if there
+ * were none. dev->sem is only dropped, and taken again, to fault in a user
+ * buffer which is not in memory.
+ */
+static ssize_t locked_io(asgn1_dev *dev, bool write, loff_t *pos,
+    struct iov_iter *iter) {
+  size_t len = iov_iter_count(iter);
+  size_t done = 0;
+  size_t fault;             /* bytes to fault in, then whether that failed */
+  ssize_t result = 0;
+  page_range range;
+
+  if (len == 0) return 0;
+
+  /* Reads lock their pages for writing too, as they may decompress them */
+  lock_page_range(dev, &range, *pos, len, true);
+  for (;;) {
+    if (write) result = write_locked(dev, pos, iter, len - done);
+    else result = read_locked(dev, pos, iter);
+    if (result > 0) {
+      done += result;
+      if (done < len) continue;
+      break;
+    }
+    if (result != -EFAULT) break;
+
+    /* Fault the buffer in with the locks dropped, as asgn1_do_write does */
+    unlock_page_range(dev, &range);
+    up_read(&dev->sem);
+    fault = min_t(size_t, len - done, PAGE_SIZE - *pos % PAGE_SIZE);
+    if (write) fault = fault_in_iov_iter_readable(iter, fault) == fault;
+    else fault = fault_in_iov_iter_writeable(iter, fault) == fault;
+    down_read(&dev->sem);
+    lock_page_range(dev, &range, *pos, len - done, true);
+    if (fault) break;
+  }
+  unlock_page_range(dev, &range);
+  return (done > 0) ? done : result;
+}
+
+
+/**
+ * This function carries out one descriptor of a batch, with dev->sem held
+ * for reading.
+ */
+static ssize_t batch_one(asgn1_dev *dev, struct asgn1_iovec *iov) {
+  bool write = iov->op == ASGN1_IO_WRITE;
+  loff_t pos = iov->offset;
+  ssize_t result;
+  struct iov_iter iter;
+  u64 start = ktime_get_ns();
+
+  if ((iov->op != ASGN1_IO_READ && !write) || iov->flags ||
+      iov->offset > MAX_LFS_FILESIZE ||
+      iov->length > MAX_LFS_FILESIZE - iov->offset)
+    return -EINVAL;
+  if (write && kv) return -EPERM;
+  if (iov->length == 0) return 0;
+  result = import_ubuf(write ? ITER_SOURCE : ITER_DEST,
+      u64_to_user_ptr(iov->buf), iov->length, &iter);
+  if (result < 0) return result;
+
+  result = locked_io(dev, write, &pos, &iter);
+  account_io(dev, write, iov->offset, iov->length, result, start);
+  return result;
+}
+
+
+/**
+ * This function reads contents of the virtual disk and writes to the user
+ * space, for read() and readv() alike. With verify_reads set, the read
+ * takes the locks a write would, so that every page can be checked against
+ * its checksum without racing with a write to it.
+ */
+static ssize_t asgn1_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+  asgn1_dev *dev = iocb->ki_filp->private_data;
+  u64 start = ktime_get_ns();
+  loff_t pos = iocb->ki_pos;
+  size_t count = iov_iter_count(to);
+  ssize_t result;
+
+  if (READ_ONCE(dev->verify_reads)) {
+    wait_restored(dev, ULONG_MAX);
+    down_read(&dev->sem);
+    result = locked_io(dev, false, &iocb->ki_pos, to);
+    up_read(&dev->sem);
+  } else {
+    result = asgn1_do_read(dev, &iocb->ki_pos, to);
+  }
+  account_io(dev, false, pos, count, result, start);
+  return result;
+}
+
+
+/**
+ * This function carries out a batch of reads and writes at scattered
+ * offsets for TEM_BATCH, taking dev->sem once for all of them. The result
+ * of each descriptor, as read() or write() would return it, goes to the
+ * results array. A descriptor failing doesn't stop the ones after it.
+ */
+static int asgn1_batch(asgn1_dev *dev, struct asgn1_batch __user *ubatch) {
+  struct asgn1_batch batch;
+  struct asgn1_iovec *iovs;
+  __s64 *results;
+  unsigned int i;
+  int result = 0;
+
+  if (copy_from_user(&batch, ubatch, sizeof(batch))) return -EFAULT;
+  if (batch.count > ASGN1_BATCH_MAX || batch.reserved) return -EINVAL;
+  if (batch.count == 0) return 0;
+
+  iovs = memdup_array_user(u64_to_user_ptr(batch.iovs), batch.count,
+      sizeof(*iovs));
+  if (IS_ERR(iovs)) return PTR_ERR(iovs);
+  results = kmalloc_array(batch.count, sizeof(*results), GFP_KERNEL);
+  if (results == NULL) {
+    result = -ENOMEM;
+    goto out;
+  }
+
+  wait_restored(dev, ULONG_MAX);
+  down_read(&dev->sem);
+  for (i = 0; i < batch.count; i++)
+    results[i] = batch_one(dev, &iovs[i]);
+  up_read(&dev->sem);
+
+  if (copy_to_user(u64_to_user_ptr(batch.results), results,
+      batch.count * sizeof(*results)))
+    result = -EFAULT;
+  kfree(results);
+out:
+  kfree(iovs);
+  return result;
+}
+
+
+/**
+ * Looks up the node snap sees at page number index, or NULL for a hole.
+ * The caller must hold dev->sem for reading and the extent locked.
+ */
+static page_node *snap_lookup(asgn1_snap *snap, unsigned long index) {
+  asgn1_dev *dev = snap->dev;
+  asgn1_snap *later = snap;
+  page_node *curr;
+
+  /* The first node kept by this or a later snapshot is the one it saw,
+   * unless it was written since, when the page was a hole then */
+  list_for_each_entry_from(later, &dev->snapshots, list) {
+    curr = xa_load(&later->pages, index);
+    if (curr) return curr->gen < snap->gen ? curr : NULL;
+  }
+  /* Otherwise the page is as it was, unless it was written since */
+  curr = xa_load(dev_pages(dev), index);
+  return (curr && curr->gen < snap->gen) ? curr : NULL;
+}
+
+
+/**
+ * This function reads a snapshot. The pages it sees never change, so each
+ * one is only looked up under the locks, and copied out with a reference
+ * held as in asgn1_do_read. A compressed page is decompressed into a
+ * buffer of its own rather than in place.
+ */
+static ssize_t asgn1_snap_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+  asgn1_snap *snap = iocb->ki_filp->private_data;
+  asgn1_dev *dev = snap->dev;
+  loff_t *pos = &iocb->ki_pos;
+  size_t count = iov_iter_count(to);
+  size_t size_read = 0;     /* size read from the snapshot in this function */
+  size_t curr_size_read;    /* size read from the snapshot in this round */
+  size_t size_to_be_read;   /* size to be read in the current round */
+  unsigned long index;
+  unsigned long nr;         /* pages left in the extent being read */
+  struct page *page;
+  struct page *bounce = NULL;  /* decompressed page */
+  page_node *curr;
+  page_range range;
+  ssize_t result = -EFAULT;
+
+  if (*pos >= snap->data_size) return 0;
+  if (*pos + count > snap->data_size) count = snap->data_size - *pos;
+
+  while (size_read < count) {
+    index = *pos >> PAGE_SHIFT;
+    page = NULL;
+    nr = 1;
+
+    /* A writer copies a whole extent at once, so lock any extent the page
+     * may be part of */
+    down_read(&dev->sem);
+    lock_page_range(dev, &range,
+        (loff_t)round_down(index, 1UL << extent_order) << PAGE_SHIFT,
+        PAGE_SIZE << extent_order, false);
+    curr = snap_lookup(snap, index);
+    if (curr && curr->page) {
+      page = nth_page(curr->page, index - curr->index);
+      nr = curr->index + (1UL << curr->order) - index;
+      get_page(page);
+    } else if (curr) {
+      if (bounce == NULL) bounce = alloc_page(GFP_KERNEL);
+      if (bounce && decompress_page(curr, bounce) == 0) {
+        page = bounce;
+        get_page(page);
+      } else {
+        result = -ENOMEM;
+      }
+    }
+    unlock_page_range(dev, &range);
+    up_read(&dev->sem);
+    if (curr && page == NULL) break;
+
+    size_to_be_read = min(count - size_read, nr * PAGE_SIZE - *pos % PAGE_SIZE);
+    if (page == NULL) {
+      curr_size_read = iov_iter_zero(size_to_be_read, to);
+    } else {
+      curr_size_read = copy_to_iter(page_address(page) + *pos % PAGE_SIZE,
+          size_to_be_read, to);
+      put_page(page);
+    }
+
+    *pos += curr_size_read;
+    size_read += curr_size_read;
+    if (curr_size_read < size_to_be_read) break;
+  }
+
+  if (bounce) __free_page(bounce);
+  return (size_read > 0) ? size_read : result;
+}
+
+
+static loff_t asgn1_snap_llseek(struct file *file, loff_t offset, int cmd) {
+  asgn1_snap *snap = file->private_data;
+  return fixed_size_llseek(file, offset, cmd, snap->data_size);
+}
+
+
+/**
+ * This function frees a snapshot and the pages it kept, except those the
+ * snapshot before it saw as well, which that one now keeps.
+ */
+static void free_snapshot(asgn1_snap *snap) {
+  asgn1_dev *dev = snap->dev;
+  asgn1_snap *prev = NULL;
+  page_node *curr;
+  unsigned long index;
+
+  down_write(&dev->sem);
+  if (!list_is_first(&snap->list, &dev->snapshots))
+    prev = list_prev_entry(snap, list);
+  xa_for_each(&snap->pages, index, curr) {
+    xa_erase(&snap->pages, index);
+    if (prev && curr->gen < prev->gen) {
+      __store_page_node(&prev->pages, curr, GFP_KERNEL | __GFP_NOFAIL);
+      continue;
+    }
+    atomic_long_sub(1UL << curr->order, &dev->snap_pages);
+    free_page_node(dev, curr);
+  }
+  list_del(&snap->list);
+  dev->snap_gen = list_empty(&dev->snapshots) ? 0 :
+      list_last_entry(&dev->snapshots, asgn1_snap, list)->gen;
+  up_write(&dev->sem);
+
+  xa_destroy(&snap->pages);
+  kfree(snap);
+}
+
+
+static int asgn1_snap_release(struct inode *inode, struct file *filp) {
+  free_snapshot(filp->private_data);
+  return 0;
+}
+
+
+static const struct file_operations asgn1_snap_fops = {
+  .owner = THIS_MODULE,
+  .read_iter = asgn1_snap_read_iter,
+  .splice_read = copy_splice_read,
+  .llseek = asgn1_snap_llseek,
+  .release = asgn1_snap_release,
+};
+
+
+/**
+ * This function takes a snapshot of the device for TEM_SNAPSHOT, returning
+ * a read-only file descriptor for it. Nothing is copied up front: pages are
+ * copied as they are first written to afterwards, so taking one is quick
+ * and it only costs the memory of what changes. Stores through existing
+ * mappings fault again so that their pages can be copied first.
+ */
+static int asgn1_snapshot(asgn1_dev *dev) {
+  asgn1_snap *snap;
+  struct file *file;
+  int fd;
+
+  snap = kzalloc(sizeof(asgn1_snap), GFP_KERNEL);
+  if (snap == NULL) return -ENOMEM;
+  snap->dev = dev;
+  xa_init(&snap->pages);
+
+  /* The pages being restored belong to it as well */
+  wait_restored(dev, ULONG_MAX);
+  down_write(&dev->sem);
+  /* Without mmap_fault, stores to a mapping can't be seen coming */
+  if (!mmap_fault && mapping_mapped(&dev->mapping)) {
+    up_write(&dev->sem);
+    kfree(snap);
+    return -EBUSY;
+  }
+  snap->gen = ++dev->generation;
+  snap->data_size = dev->data_size;
+  list_add_tail(&snap->list, &dev->snapshots);
+  dev->snap_gen = snap->gen;
+  zap_mappings(dev, 0, ULONG_MAX >> PAGE_SHIFT);
+  up_write(&dev->sem);
+
+  fd = get_unused_fd_flags(O_CLOEXEC);
+  if (fd < 0) goto fail_fd;
+  file = anon_inode_getfile("[asgn1-snapshot]", &asgn1_snap_fops, snap,
+      O_RDONLY);
+  if (IS_ERR(file)) {
+    put_unused_fd(fd);
+    fd = PTR_ERR(file);
+    goto fail_fd;
+  }
+  file->f_mode |= FMODE_PREAD;
+  fd_install(fd, file);
+  return fd;
+
+  /* cleanup code called when the file can't be made */
+fail_fd:
+  free_snapshot(snap);
+  return fd;
+}
+
+
+/**
+ * Checks every page with a checksum against it, in the background, noting
+ * the pages which don't match in dev->scrub. Pages being changed through a
+ * mapping are skipped. Compressed pages are checked decompressed.
+ */
+static void asgn1_scrub(struct work_struct *work) {
+  asgn1_dev *dev = container_of(work, asgn1_dev, scrub_work);
+  struct page *bounce = NULL;  /* decompressed page */
+  unsigned long index = 0;
+  page_range range;
+  page_node *curr;
+  struct page *page;
+  bool match;
+
+  while (!READ_ONCE(dev->scrub_stop) &&
+      xa_find(&dev->crcs, &index, ULONG_MAX, XA_PRESENT)) {
+    down_read(&dev->sem);
+    lock_page_range(dev, &range, (loff_t)index << PAGE_SHIFT, PAGE_SIZE, false);
+    page = NULL;
+    curr = xa_load(dev_pages(dev), index);
+    if (curr && !xa_get_mark(&dev->crcs, index, CRC_STALE)) {
+      if (curr->page) {
+        page = nth_page(curr->page, index - curr->index);
+      } else {
+        if (bounce == NULL) bounce = alloc_page(GFP_KERNEL);
+        if (bounce && decompress_page(curr, bounce) == 0) page = bounce;
+      }
+    }
+    match = page == NULL || check_crc(dev, page, index);
+    unlock_page_range(dev, &range);
+    up_read(&dev->sem);
+
+    if (page) {
+      spin_lock(&dev->scrub_lock);
+      dev->scrub.checked++;
+      if (!match && dev->scrub.mismatches++ < ASGN1_SCRUB_BAD_MAX)
+        dev->scrub.bad[dev->scrub.mismatches - 1] = (u64)index << PAGE_SHIFT;
+      spin_unlock(&dev->scrub_lock);
+    }
+    if (index++ == ULONG_MAX) break;
+    cond_resched();
+  }
+  if (bounce) __free_page(bounce);
+
+  spin_lock(&dev->scrub_lock);
+  dev->scrub.running = 0;
+  spin_unlock(&dev->scrub_lock);
+}
+
+
+/**
+ * Starts a scrub of the device, unless one is already running.
+ */
+static int start_scrub(asgn1_dev *dev) {
+  if (!checksum) return -EOPNOTSUPP;
+
+  spin_lock(&dev->scrub_lock);
+  if (dev->scrub.running) {
+    spin_unlock(&dev->scrub_lock);
+    return -EBUSY;
+  }
+  memset(&dev->scrub, 0, sizeof(dev->scrub));
+  dev->scrub.running = 1;
+  spin_unlock(&dev->scrub_lock);
+
+  queue_work(system_unbound_wq, &dev->scrub_work);
+  return 0;
+}
+
+
+/**
+ * Sets the value of a key of a key-value store. The value is written to a
+ * place no other key has, and only then is the key pointed at it, so gets
+ * see the old value or the new one whole. The place of the old value is
+ * given back once no get can be reading it.
+ */
+static int kv_put(asgn1_dev *dev, struct asgn1_kv __user *arg) {
+  struct asgn1_kv pair;
+  kv_entry *entry;
+  kv_entry *old;
+  struct iov_iter iter;
+  unsigned long gen;
+  loff_t pos;
+  ssize_t written;
+  u64 hash;
+  u64 start = ktime_get_ns();
+  int result = 0;
+
+  if (copy_from_user(&pair, arg, sizeof(pair))) return -EFAULT;
+  if ((pair.flags & ~(ASGN1_KV_CREATE | ASGN1_KV_REPLACE)) ||
+      pair.flags == (ASGN1_KV_CREATE | ASGN1_KV_REPLACE) ||
+      pair.key_len == 0 || pair.key_len > ASGN1_KV_KEY_MAX ||
+      pair.value_len > ASGN1_KV_VALUE_MAX)
+    return -EINVAL;
+
+  entry = kmalloc(struct_size(entry, key, pair.key_len), GFP_KERNEL);
+  if (entry == NULL) return -ENOMEM;
+  if (copy_from_user(entry->key, u64_to_user_ptr(pair.key), pair.key_len)) {
+    result = -EFAULT;
+    goto fail_entry;
+  }
+  entry->key_len = pair.key_len;
+  entry->len = pair.value_len;
+  hash = xxh64(entry->key, entry->key_len, 0);
+
+  /* kv_sem keeps a reset from handing the place to anyone else meanwhile */
+  down_read(&dev->kv_sem);
+  entry->offset = kv_alloc(dev, entry->len);
+  if (entry->offset < 0) {
+    up_read(&dev->kv_sem);
+    result = entry->offset;
+    goto fail_entry;
+  }
+  gen = dev->kv_gen;
+  if (entry->len) {
+    result = import_ubuf(ITER_SOURCE, u64_to_user_ptr(pair.value), entry->len,
+        &iter);
+    if (result == 0) {
+      pos = entry->offset;
+      down_read(&dev->sem);
+      written = locked_io(dev, true, &pos, &iter);
+      up_read(&dev->sem);
+      account_io(dev, true, entry->offset, entry->len, written, start);
+      if (written < 0) result = written;
+      else if (written != entry->len) result = -EFAULT;
+    }
+    if (result < 0) {
+      kv_release(dev, entry->offset, entry->len);
+      up_read(&dev->kv_sem);
+      goto fail_entry;
+    }
+  }
+  up_read(&dev->kv_sem);
+
+  down_write(&dev->kv_sem);
+  /* A reset since has taken the place back, the put went before it */
+  if (dev->kv_gen != gen) {
+    up_write(&dev->kv_sem);
+    kfree(entry);
+    return 0;
+  }
+  old = kv_lookup(dev, entry->key, entry->key_len, hash);
+  if (old ? (pair.flags & ASGN1_KV_CREATE) : (pair.flags & ASGN1_KV_REPLACE)) {
+    result = old ? -EEXIST : -ENOENT;
+    goto fail_locked;
+  }
+  if (old) {
+    /* Replacing an entry doesn't allocate */
+    entry->id = old->id;
+    xa_store(&dev->kv_ids, entry->id, entry, GFP_KERNEL);
+    hash_del(&old->hash);
+    kv_release(dev, old->offset, old->len);
+  } else {
+    result = xa_alloc(&dev->kv_ids, &entry->id, entry, xa_limit_32b,
+        GFP_KERNEL);
+    if (result < 0) goto fail_locked;
+  }
+  hash_add(dev->kv_hash, &entry->hash, hash);
+  up_write(&dev->kv_sem);
+  kfree(old);
+  return 0;
+
+fail_locked:
+  kv_release(dev, entry->offset, entry->len);
+  up_write(&dev->kv_sem);
+fail_entry:
+  kfree(entry);
+  return result;
+}
+
+
+/**
+ * Copies in the key of a get or a delete.
+ */
+static char *kv_key(struct asgn1_kv *pair, u64 *hash) {
+  char *key;
+
+  if (pair->flags || pair->key_len == 0 || pair->key_len > ASGN1_KV_KEY_MAX)
+    return ERR_PTR(-EINVAL);
+  key = memdup_user(u64_to_user_ptr(pair->key), pair->key_len);
+  if (!IS_ERR(key)) *hash = xxh64(key, pair->key_len, 0);
+  return key;
+}
+
+
+/**
+ * Copies as much of the value of a key as fits, and tells where the value
+ * is so that a read-only mapping of the ramdisk can read it instead.
+ */
+static int kv_get(asgn1_dev *dev, struct asgn1_kv __user *arg) {
+  struct asgn1_kv pair;
+  kv_entry *entry;
+  struct iov_iter iter;
+  loff_t pos;
+  size_t len;
+  ssize_t done;
+  char *key;
+  u64 hash;
+  u64 start = ktime_get_ns();
+  int result = 0;
+
+  if (copy_from_user(&pair, arg, sizeof(pair))) return -EFAULT;
+  key = kv_key(&pair, &hash);
+  if (IS_ERR(key)) return PTR_ERR(key);
+
+  down_read(&dev->kv_sem);
+  entry = kv_lookup(dev, key, pair.key_len, hash);
+  if (entry == NULL) {
+    result = -ENOENT;
+    goto out;
+  }
+  len = min_t(u64, pair.value_len, entry->len);
+  if (pair.value && len) {
+    result = import_ubuf(ITER_DEST, u64_to_user_ptr(pair.value), len, &iter);
+    if (result < 0) goto out;
+    pos = entry->offset;
+    down_read(&dev->sem);
+    done = locked_io(dev, false, &pos, &iter);
+    up_read(&dev->sem);
+    account_io(dev, false, entry->offset, len, done, start);
+    if (done < 0) {
+      result = done;
+      goto out;
+    }
+    if (done != len) {
+      result = -EFAULT;
+      goto out;
+    }
+  }
+  pair.value_len = entry->len;
+  pair.offset = entry->offset;
+
+out:
+  up_read(&dev->kv_sem);
+  kfree(key);
+  if (result == 0 && copy_to_user(arg, &pair, sizeof(pair))) result = -EFAULT;
+  return result;
+}
+
+
+/**
+ * Deletes a key, giving back the place of its value.
+ */
+static int kv_delete(asgn1_dev *dev, struct asgn1_kv __user *arg) {
+  struct asgn1_kv pair;
+  kv_entry *entry;
+  char *key;
+  u64 hash;
+  int result = 0;
+
+  if (copy_from_user(&pair, arg, sizeof(pair))) return -EFAULT;
+  key = kv_key(&pair, &hash);
+  if (IS_ERR(key)) return PTR_ERR(key);
+
+  down_write(&dev->kv_sem);
+  entry = kv_lookup(dev, key, pair.key_len, hash);
+  if (entry) {
+    hash_del(&entry->hash);
+    xa_erase(&dev->kv_ids, entry->id);
+    kv_release(dev, entry->offset, entry->len);
+  } else {
+    result = -ENOENT;
+  }
+  up_write(&dev->kv_sem);
+  kfree(entry);
+  kfree(key);
+  return result;
+}
+
+
+/**
+ * Copies out the keys from the cursor on, as many as fit in the buffer.
+ * The records are built in a bounce buffer as kv_sem can't be held while
+ * copying to user space.
+ */
+static int kv_scan(asgn1_dev *dev, struct asgn1_kv_scan __user *arg) {
+  struct asgn1_kv_scan scan;
+  struct asgn1_kv_rec *rec;
+  kv_entry *entry;
+  unsigned long index;
+  size_t used = 0;
+  size_t size;
+  bool full = false;
+  char *buf;
+  int result = 0;
+
+  if (copy_from_user(&scan, arg, sizeof(scan))) return -EFAULT;
+  if (scan.buf_len > ASGN1_KV_SCAN_MAX) return -EINVAL;
+  scan.count = 0;
+  buf = kvmalloc(scan.buf_len, GFP_KERNEL);
+  if (buf == NULL) return -ENOMEM;
+
+  down_read(&dev->kv_sem);
+  if (scan.cursor <= U32_MAX) {
+    xa_for_each_start(&dev->kv_ids, index, entry, scan.cursor) {
+      size = sizeof(*rec) + ALIGN(entry->key_len, 8);
+      if (size > scan.buf_len - used) {
+        full = true;
+        break;
+      }
+      rec = (struct asgn1_kv_rec *)(buf + used);
+      rec->offset = entry->offset;
+      rec->value_len = entry->len;
+      rec->key_len = entry->key_len;
+      rec->reserved = 0;
+      memcpy(rec + 1, entry->key, entry->key_len);
+      memset((char *)(rec + 1) + entry->key_len, 0,
+          size - sizeof(*rec) - entry->key_len);
+      used += size;
+      scan.count++;
+      scan.cursor = (u64)index + 1;
+    }
+  }
+  up_read(&dev->kv_sem);
+
+  if (full && scan.count == 0) result = -EOVERFLOW;
+  else if (copy_to_user(u64_to_user_ptr(scan.buf), buf, used)) result = -EFAULT;
+  kvfree(buf);
+  if (result == 0 && copy_to_user(arg, &scan, sizeof(scan))) result = -EFAULT;
+  return result;
+}
+
+
+/**
+ * The ioctl function, which nothing needs to be done in this case.
+ * This module supports 16 options by giving it the following commands:
+ * 1 - The integer you pass with be used to set the new max processes allowed.
+ *     You cannot set it to a number lower than the current amount of processes.
+ *
+ * 2 - Can be used to retrive the current amount of processes using the device.
+ * 3 - Can be used to free all of the memory pages used by the device.
+ * 4 - Frees the pages inside the struct asgn1_range passed, leaving a hole.
+ * 5 - Saves the contents of the device to its backing file.
+ * 6 - Preallocates the pages of the struct asgn1_reserve passed.
+ * 7 - Sets the NUMA placement of new pages to the struct asgn1_placement
+ *     passed.
+ * 8 - Carries out the reads and writes of the struct asgn1_batch passed.
+ * 9 - Takes a snapshot of the device, returning a file descriptor to read
+ *     it.
+ * 10 - Starts checking every page against its checksum in the background.
+ * 11 - Copies the progress and results of the last scrub to the struct
+ *      asgn1_scrub passed.
+ * 12 - Waits until the pages of earlier resets have been freed.
+ * 13 - Sets the value of the key of the struct asgn1_kv passed.
+ * 14 - Copies the value of the key of the struct asgn1_kv passed, and
+ *      where it is in the ramdisk.
+ * 15 - Deletes the key of the struct asgn1_kv passed.
+ * 16 - Copies the keys from the cursor of the struct asgn1_kv_scan passed.
+ *
+ * 13 to 16 fail with EOPNOTSUPP unless the kv module parameter is set.
+ */
+long asgn1_ioctl (struct file *filp, unsigned cmd, unsigned long arg) {
+  asgn1_dev *dev = filp->private_data;
+  int nr;
+  int new_nprocs;
+  int pages_allocated;
+  int result;
+  struct asgn1_range range;
+  struct asgn1_reserve reserve;
+  struct asgn1_placement place;
+  struct asgn1_scrub scrub;
+
+  if (_IOC_TYPE(cmd) != MYIOC_TYPE) return -EINVAL;
+  nr = _IOC_NR(cmd);
+
+  switch (nr) {
+    case SET_NPROC_OP:
+      result = get_user(new_nprocs, (int *) arg);
+      if (result) {
+        printk(KERN_WARNING "%s: Error when retriving the new nprocs value\n", MYDEV_NAME);
+        return -EINVAL;
+      }
+      if (new_nprocs < atomic_read(&dev->nprocs)) return -EINVAL;
+      atomic_set(&dev->max_nprocs, new_nprocs);
+      return 0;
+    case GET_CUR_PROCS_OP:
+      pages_allocated = atomic_read(&dev->nprocs);
+      result = put_user(pages_allocated, (int *) arg);
+      if (result) {
+        printk(KERN_WARNING
+            "%s: Error when copying the procs value to userspace\n", MYDEV_NAME);
+        return -EINVAL;
+      }
+      return 0;
+    case RESET_DEVICE_OP:
+      if (atomic_read(&dev->nprocs) > 1) return -EINVAL;
+      drop_all_pages(dev, false);
+      return 0;
+    case PUNCH_HOLE_OP:
+      if (kv) return -EPERM;
+      if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+        return -EFAULT;
+      if (range.offset > MAX_LFS_FILESIZE || range.length > MAX_LFS_FILESIZE)
+        return -EINVAL;
+      return punch_hole(dev, range.offset, range.length);
+    case SAVE_OP:
+      return save_ramdisk(dev);
+    case RESERVE_OP:
+      if (kv) return -EPERM;
+      if (copy_from_user(&reserve, (void __user *) arg, sizeof(reserve)))
+        return -EFAULT;
+      if (reserve.flags & ~(ASGN1_RESERVE_ZERO | ASGN1_RESERVE_KEEP_SIZE) ||
+          reserve.reserved || reserve.offset > MAX_LFS_FILESIZE ||
+          reserve.length > MAX_LFS_FILESIZE)
+        return -EINVAL;
+      return reserve_range(dev, reserve.offset, reserve.length,
+          reserve.flags & ASGN1_RESERVE_ZERO,
+          reserve.flags & ASGN1_RESERVE_KEEP_SIZE);
+    case PLACEMENT_OP:
+      if (copy_from_user(&place, (void __user *) arg, sizeof(place)))
+        return -EFAULT;
+      result = check_placement(place.policy, place.node);
+      if (result < 0) return result;
+      set_placement(dev, place.policy, place.node);
+      return 0;
+    case BATCH_OP:
+      return asgn1_batch(dev, (struct asgn1_batch __user *) arg);
+    case SNAPSHOT_OP:
+      return asgn1_snapshot(dev);
+    case SCRUB_OP:
+      return start_scrub(dev);
+    case SCRUB_STATUS_OP:
+      spin_lock(&dev->scrub_lock);
+      scrub = dev->scrub;
+      spin_unlock(&dev->scrub_lock);
+      if (copy_to_user((void __user *) arg, &scrub, sizeof(scrub)))
+        return -EFAULT;
+      return 0;
+    case FLUSH_FREE_OP:
+      flush_work(&dev->free_work);
+      return 0;
+    case KV_PUT_OP:
+      if (!kv) return -EOPNOTSUPP;
+      return kv_put(dev, (struct asgn1_kv __user *) arg);
+    case KV_GET_OP:
+      if (!kv) return -EOPNOTSUPP;
+      return kv_get(dev, (struct asgn1_kv __user *) arg);
+    case KV_DELETE_OP:
+      if (!kv) return -EOPNOTSUPP;
+      return kv_delete(dev, (struct asgn1_kv __user *) arg);
+    case KV_SCAN_OP:
+      if (!kv) return -EOPNOTSUPP;
+      return kv_scan(dev, (struct asgn1_kv_scan __user *) arg);
+    default:
+      printk(KERN_WARNING "ioctl command doesn't match any available\n");
+      return -EINVAL;
+  }
+}
+
+
+/**
+ * The sysfs attributes of each device, found under
+ * /sys/class/asgn1/asgn1N/.
+ */
+static ssize_t data_size_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%zu\n", dev->data_size);
+}
+static DEVICE_ATTR_RO(data_size);
+
+static ssize_t num_pages_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->num_pages));
+}
+static DEVICE_ATTR_RO(num_pages);
+
+static ssize_t nprocs_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%d\n", atomic_read(&dev->nprocs));
+}
+static DEVICE_ATTR_RO(nprocs);
+
+static ssize_t max_nprocs_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%d\n", atomic_read(&dev->max_nprocs));
+}
+static DEVICE_ATTR_RO(max_nprocs);
+
+static ssize_t compressed_pages_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->comp_pages));
+}
+static DEVICE_ATTR_RO(compressed_pages);
+
+static ssize_t compressed_bytes_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->comp_bytes));
+}
+static DEVICE_ATTR_RO(compressed_bytes);
+
+/* Uncompressed over compressed size of the compressed pages */
+static ssize_t compress_ratio_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  unsigned long bytes = atomic_long_read(&dev->comp_bytes);
+  unsigned long ratio;
+
+  if (bytes == 0) return sysfs_emit(buf, "0.00\n");
+  ratio = atomic_long_read(&dev->comp_pages) * PAGE_SIZE * 100 / bytes;
+  return sysfs_emit(buf, "%lu.%02lu\n", ratio / 100, ratio % 100);
+}
+static DEVICE_ATTR_RO(compress_ratio);
+
+static ssize_t compress_hits_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%lld\n", percpu_counter_sum(&dev->comp_hits));
+}
+static DEVICE_ATTR_RO(compress_hits);
+
+static ssize_t compress_misses_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%lld\n", percpu_counter_sum(&dev->comp_misses));
+}
+static DEVICE_ATTR_RO(compress_misses);
+
+static ssize_t dedup_saved_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%lu\n",
+      atomic_long_read(&dev->dedup_saved) * PAGE_SIZE);
+}
+static DEVICE_ATTR_RO(dedup_saved);
+
+static ssize_t zero_pages_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->zero_pages));
+}
+static DEVICE_ATTR_RO(zero_pages);
+
+static ssize_t reserved_pages_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->reserved_pages));
+}
+static DEVICE_ATTR_RO(reserved_pages);
+
+static ssize_t max_bytes_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->max_bytes));
+}
+
+/* Lowering the limit below what is held only stops the ramdisk growing */
+static ssize_t max_bytes_store(struct device *device,
+    struct device_attribute *attr, const char *buf, size_t count) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  unsigned long limit;
+  int result;
+
+  result = kstrtoul(buf, 0, &limit);
+  if (result < 0) return result;
+  WRITE_ONCE(dev->max_bytes, limit);
+  return count;
+}
+static DEVICE_ATTR_RW(max_bytes);
+
+static ssize_t placement_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+
+  switch (READ_ONCE(dev->placement)) {
+    case ASGN1_PLACE_INTERLEAVE:
+      return sysfs_emit(buf, "interleave\n");
+    case ASGN1_PLACE_NODE:
+      return sysfs_emit(buf, "%d\n", READ_ONCE(dev->place_node));
+    default:
+      return sysfs_emit(buf, "local\n");
+  }
+}
+
+static ssize_t placement_store(struct device *device,
+    struct device_attribute *attr, const char *buf, size_t count) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  int policy, node;
+  int result;
+
+  result = parse_placement(buf, &policy, &node);
+  if (result < 0) return result;
+  set_placement(dev, policy, node);
+  return count;
+}
+static DEVICE_ATTR_RW(placement);
+
+/**
+ * The pages held on each node, as "N<node>=<pages>" like numa_maps. A page
+ * shared by several page nodes counts once.
+ */
+static ssize_t node_pages_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  XA_STATE(xas, NULL, 0);
+  unsigned long *counts;
+  page_node *curr;
+  shared_page *shared;
+  ssize_t len = 0;
+  int bkt, node;
+
+  counts = kcalloc(nr_node_ids, sizeof(*counts), GFP_KERNEL);
+  if (counts == NULL) return -ENOMEM;
+
+  /* Page nodes are freed after a grace period, so the walk needs no lock */
+  rcu_read_lock();
+  xas.xa = dev_pages(dev);
+  xas_for_each(&xas, curr, ULONG_MAX) {
+    if (xas_retry(&xas, curr)) continue;
+    if (curr->page == NULL || curr->shared) continue;
+    counts[page_to_nid(curr->page)] += 1UL << curr->order;
+  }
+  rcu_read_unlock();
+
+  spin_lock(&dev->dedup_lock);
+  hash_for_each(dev->dedup_hash, bkt, shared, hash)
+    counts[page_to_nid(shared->page)]++;
+  spin_unlock(&dev->dedup_lock);
+
+  for_each_node_state(node, N_MEMORY)
+    len += sysfs_emit_at(buf, len, "%sN%d=%lu", len ? " " : "", node,
+        counts[node]);
+  len += sysfs_emit_at(buf, len, "\n");
+  kfree(counts);
+  return len;
+}
+static DEVICE_ATTR_RO(node_pages);
+
+static ssize_t snapshot_pages_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->snap_pages));
+}
+static DEVICE_ATTR_RO(snapshot_pages);
+
+static ssize_t verify_reads_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%d\n", READ_ONCE(dev->verify_reads));
+}
+
+/* There is nothing to verify against without checksum set */
+static ssize_t verify_reads_store(struct device *device,
+    struct device_attribute *attr, const char *buf, size_t count) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  bool verify;
+  int result;
+
+  result = kstrtobool(buf, &verify);
+  if (result < 0) return result;
+  if (verify && !checksum) return -EINVAL;
+  WRITE_ONCE(dev->verify_reads, verify);
+  return count;
+}
+static DEVICE_ATTR_RW(verify_reads);
+
+static ssize_t checksum_errors_show(struct device *device,
+    struct device_attribute *attr, char *buf) {
+  asgn1_dev *dev = dev_get_drvdata(device);
+  return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->crc_errors));
+}
+static DEVICE_ATTR_RO(checksum_errors);
+
+static struct attribute *asgn1_attrs[] = {
+  &dev_attr_data_size.attr,
+  &dev_attr_num_pages.attr,
+  &dev_attr_nprocs.attr,
+  &dev_attr_max_nprocs.attr,
+  &dev_attr_compressed_pages.attr,
+  &dev_attr_compressed_bytes.attr,
+  &dev_attr_compress_ratio.attr,
+  &dev_attr_compress_hits.attr,
+  &dev_attr_compress_misses.attr,
+  &dev_attr_dedup_saved.attr,
+  &dev_attr_zero_pages.attr,
+  &dev_attr_reserved_pages.attr,
+  &dev_attr_max_bytes.attr,
+  &dev_attr_placement.attr,
+  &dev_attr_node_pages.attr,
+  &dev_attr_snapshot_pages.attr,
+  &dev_attr_verify_reads.attr,
+  &dev_attr_checksum_errors.attr,
+  NULL,
+};
+
+static const struct attribute_group asgn1_group = {
+  .attrs = asgn1_attrs,
+};
+
+/* The per CPU counters, in a stats directory of their own */
+#define STAT_ATTR(name)                                                 \
+static ssize_t name##_show(struct device *device,                       \
+    struct device_attribute *attr, char *buf) {                         \
+  asgn1_dev *dev = dev_get_drvdata(device);                             \
+  return sysfs_emit(buf, "%llu\n",                                      \
+      sum_stat(dev, offsetof(asgn1_stats, name)));                      \
+}                                                                       \
+static DEVICE_ATTR_RO(name)
+
+STAT_ATTR(reads);
+STAT_ATTR(writes);
+STAT_ATTR(read_bytes);
+STAT_ATTR(write_bytes);
+STAT_ATTR(page_allocs);
+STAT_ATTR(alloc_failures);
+STAT_ATTR(faults);
+STAT_ATTR(open_busy);
+STAT_ATTR(pool_hits);
+STAT_ATTR(pool_misses);
+
+static struct attribute *asgn1_stats_attrs[] = {
+  &dev_attr_reads.attr,
+  &dev_attr_writes.attr,
+  &dev_attr_read_bytes.attr,
+  &dev_attr_write_bytes.attr,
+  &dev_attr_page_allocs.attr,
+  &dev_attr_alloc_failures.attr,
+  &dev_attr_faults.attr,
+  &dev_attr_open_busy.attr,
+  &dev_attr_pool_hits.attr,
+  &dev_attr_pool_misses.attr,
+  NULL,
+};
+
+static const struct attribute_group asgn1_stats_group = {
+  .name = "stats",
+  .attrs = asgn1_stats_attrs,
+};
+
+static const struct attribute_group *asgn1_groups[] = {
+  &asgn1_group,
+  &asgn1_stats_group,
+  NULL,
+};
+
+
+/**
+ * Prints a latency histogram summed over every CPU, one line per bucket
+ * from the first to the last one in use. Each line gives the lower bound
+ * of the bucket in ns and the number of calls in it.
+ */
+static void show_latency(struct seq_file *m, asgn1_dev *dev, size_t offset) {
+  u64 count[LAT_BUCKETS];
+  int first = -1, last = -1;
+  int i;
+
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    count[i] = sum_stat(dev, offset + i * sizeof(u64));
+    if (count[i] == 0) continue;
+    if (first < 0) first = i;
+    last = i;
+  }
+  for (i = first; first >= 0 && i <= last; i++)
+    seq_printf(m, "%12llu %llu\n", 1ULL << i, count[i]);
+}
+
+static int read_latency_show(struct seq_file *m, void *v) {
+  show_latency(m, m->private, offsetof(asgn1_stats, read_lat));
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(read_latency);
+
+static int write_latency_show(struct seq_file *m, void *v) {
+  show_latency(m, m->private, offsetof(asgn1_stats, write_lat));
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(write_latency);
+
+
+/**
+ * Returns the node of page number index if it still holds page, which the
+ * caller has locked so that the node can't be freed. Returns NULL if the
+ * page was taken out of the page index meanwhile.
+ */
+static page_node *node_of_page(asgn1_dev *dev, unsigned long index,
+    struct page *page) {
+  page_node *curr;
+
+  rcu_read_lock();
+  curr = xa_load(dev_pages(dev), index);
+  if (curr && (curr->page == NULL ||
+        nth_page(curr->page, index - curr->index) != page))
+    curr = NULL;
+  rcu_read_unlock();
+  return curr;
+}
+
+
+/**
+ * Finds the page backing a faulting address of a mapping made with
+ * mmap_fault set. Present pages are found locklessly, only holes take
+ * dev->sem to allocate. Only a write fills a hole, a read maps the shared
+ * zeroed hole page read-only until page_mkwrite fills it. Pages past the
+ * end of the ramdisk are only handed out to writers.
+ */
+static vm_fault_t asgn1_vm_fault(struct vm_fault *vmf)
+{
+  asgn1_dev *dev = vmf->vma->vm_file->private_data;
+  page_node *curr;
+  struct page *page;
+  struct folio *folio;
+  int err;
+
+  this_cpu_inc(dev->stats->faults);
+retry:
+  page = get_ramdisk_page(dev, vmf->pgoff, NULL);
+  if (IS_ERR(page)) return VM_FAULT_OOM;
+  if (page == NULL && !(vmf->flags & FAULT_FLAG_WRITE)) {
+    if (((loff_t)vmf->pgoff << PAGE_SHIFT) >= READ_ONCE(dev->data_size))
+      return VM_FAULT_SIGBUS;
+    /* Locked until it is mapped, so a write filling the hole meanwhile
+     * zaps it afterwards, if it didn't fill it before the check */
+    folio = page_folio(asgn1_hole_page);
+    folio_lock(folio);
+    rcu_read_lock();
+    curr = xa_load(dev_pages(dev), vmf->pgoff);
+    rcu_read_unlock();
+    if (curr) {
+      folio_unlock(folio);
+      goto retry;
+    }
+    folio_get(folio);
+    vmf->page = asgn1_hole_page;
+    return VM_FAULT_LOCKED;
+  }
+  if (page == NULL) {
+    down_read(&dev->sem);
+    curr = alloc_page_node(dev, vmf->pgoff);
+    up_read(&dev->sem);
+    if (curr == ERR_PTR(-ENOSPC)) return VM_FAULT_SIGBUS;
+    if (IS_ERR(curr)) return VM_FAULT_OOM;
+    goto retry;
+  }
+
+  /* The page is returned locked, so a reset or hole punch freeing it waits
+   * until it is in the mapping and can be zapped again */
+  folio = page_folio(page);
+  folio_lock(folio);
+  curr = node_of_page(dev, vmf->pgoff, page);
+  if (curr == NULL) {
+    folio_unlock(folio);
+    folio_put(folio);
+    goto retry;
+  }
+  /* A shared page belongs to no file, and a store through the mapping
+   * couldn't be seen coming, so the mapping gets a page of its own. So does
+   * a writer of a page a snapshot needs */
+  if (READ_ONCE(curr->shared) ||
+      ((vmf->flags & FAULT_FLAG_WRITE) && curr->gen < READ_ONCE(dev->snap_gen))) {
+    folio_unlock(folio);
+    folio_put(folio);
+    /* A copy for a snapshot over the limit fails as a hole would */
+    err = own_page(dev, vmf->pgoff, vmf->flags & FAULT_FLAG_WRITE);
+    if (err) return vmf_error(err);
+    goto retry;
+  }
+  /* page_mkwrite only accepts pages which belong to the mapped file */
+  folio->mapping = &dev->mapping;
+  folio->index = curr->index;
+
+  vmf->page = page;
+  return VM_FAULT_LOCKED;
+}
+
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/**
+ * Maps a whole PMD sized extent with a single huge page table entry, when
+ * the mapping lines up with it. Anything else falls back to asgn1_vm_fault
+ * one page at a time. Because the writer doesn't fault again for the rest
+ * of the extent, a write grows data_size over all of it.
+ */
+static vm_fault_t asgn1_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+  asgn1_dev *dev = vmf->vma->vm_file->private_data;
+  unsigned long haddr = vmf->address & HPAGE_PMD_MASK;
+  pgoff_t pgoff = vmf->pgoff - ((vmf->address - haddr) >> PAGE_SHIFT);
+  bool write = vmf->flags & FAULT_FLAG_WRITE;
+  page_node *curr;
+  struct page *page;
+  struct folio *folio;
+  vm_fault_t result;
+  int err;
+
+  if (order != HPAGE_PMD_ORDER || pgoff % HPAGE_PMD_NR ||
+      haddr < vmf->vma->vm_start || haddr + HPAGE_PMD_SIZE > vmf->vma->vm_end)
+    return VM_FAULT_FALLBACK;
+
+  this_cpu_inc(dev->stats->faults);
+retry:
+  page = get_ramdisk_page(dev, pgoff, NULL);
+  if (IS_ERR(page)) return VM_FAULT_OOM;
+  if (page == NULL) {
+    /* Reads of a hole map the hole page one page at a time */
+    if (!write) return VM_FAULT_FALLBACK;
+    down_read(&dev->sem);
+    curr = alloc_page_node(dev, pgoff);
+    up_read(&dev->sem);
+    if (curr == ERR_PTR(-ENOSPC)) return VM_FAULT_SIGBUS;
+    if (IS_ERR(curr)) return VM_FAULT_OOM;
+    goto retry;
+  }
+
+  folio = page_folio(page);
+  if (folio_order(folio) != HPAGE_PMD_ORDER) {
+    folio_put(folio);
+    return VM_FAULT_FALLBACK;
+  }
+
+  folio_lock(folio);
+  curr = node_of_page(dev, pgoff, page);
+  if (curr == NULL) {
+    folio_unlock(folio);
+    folio_put(folio);
+    goto retry;
+  }
+  if (write && curr->gen < READ_ONCE(dev->snap_gen)) {
+    folio_unlock(folio);
+    folio_put(folio);
+    err = own_page(dev, pgoff, true);
+    if (err) return vmf_error(err);
+    goto retry;
+  }
+  folio->mapping = &dev->mapping;
+  folio->index = curr->index;
+  if (write && mark_crcs_stale(dev, pgoff, pgoff + HPAGE_PMD_NR - 1) < 0) {
+    folio_unlock(folio);
+    folio_put(folio);
+    return VM_FAULT_OOM;
+  }
+  if (write) unreserve_page_node(dev, curr);
+
+  result = vmf_insert_folio_pmd(vmf, folio, write);
+  folio_unlock(folio);
+  folio_put(folio);
+
+  if (write && !(result & VM_FAULT_ERROR))
+    grow_data_size(dev, (size_t)(pgoff + HPAGE_PMD_NR) << PAGE_SHIFT);
+  return result;
+}
+#endif
+
+
+/**
+ * Called the first time a MAP_SHARED writer stores to a page. data_size grows
+ * to cover the written page, anything skipped over stays a hole. A store to
+ * the hole page fills the hole, which zaps the hole page so the store
+ * faults the new page in.
+ */
+static vm_fault_t asgn1_vm_page_mkwrite(struct vm_fault *vmf)
+{
+  asgn1_dev *dev = vmf->vma->vm_file->private_data;
+  struct folio *folio = page_folio(vmf->page);
+  size_t page_end = (vmf->pgoff + 1) << PAGE_SHIFT;
+  page_node *curr;
+  int err;
+
+  if (vmf->page == asgn1_hole_page) {
+    down_read(&dev->sem);
+    curr = alloc_page_node(dev, vmf->pgoff);
+    up_read(&dev->sem);
+    if (curr == ERR_PTR(-ENOSPC)) return VM_FAULT_SIGBUS;
+    if (IS_ERR(curr)) return VM_FAULT_OOM;
+    return VM_FAULT_NOPAGE;
+  }
+
+  folio_lock(folio);
+  /* The page was thrown away by a reset or a hole punch since it was
+   * faulted in */
+  if (folio->mapping != &dev->mapping) {
+    folio_unlock(folio);
+    return VM_FAULT_SIGBUS;
+  }
+  /* Nothing can free the node while the page is locked, but it may have
+   * been handed to a snapshot, whose copy is faulted in again once the
+   * mapping is zapped */
+  curr = node_of_page(dev, vmf->pgoff, vmf->page);
+  if (curr == NULL) {
+    folio_unlock(folio);
+    return VM_FAULT_NOPAGE;
+  }
+  if (curr->gen < READ_ONCE(dev->snap_gen)) {
+    folio_unlock(folio);
+    err = own_page(dev, vmf->pgoff, true);
+    if (err) return vmf_error(err);
+    return VM_FAULT_NOPAGE;
+  }
+  if (mark_crcs_stale(dev, vmf->pgoff, vmf->pgoff) < 0) {
+    folio_unlock(folio);
+    return VM_FAULT_OOM;
+  }
+  unreserve_page_node(dev, curr);
+
+  grow_data_size(dev, page_end);
+
+  return VM_FAULT_LOCKED;
+}
+
+
+/**
+ * Checksums again the pages first to last which were marked stale when they
+ * were mapped for writing, with dev->sem held for reading. With mmap_fault
+ * set each page is write protected first, so a later store marks it stale
+ * again. Remapped pages can't be, so they are left until nothing maps the
+ * ramdisk for writing.
+ */
+static void settle_crcs(asgn1_dev *dev, unsigned long first,
+    unsigned long last) {
+  unsigned long index = first;
+  page_range range;
+  page_node *curr;
+  struct page *page;
+
+  if (!checksum) return;
+  if (!mmap_fault && mapping_writably_mapped(&dev->mapping))
+    return;
+
+  while (xa_find(&dev->crcs, &index, last, CRC_STALE)) {
+    lock_page_range(dev, &range, (loff_t)index << PAGE_SHIFT, PAGE_SIZE, true);
+    curr = xa_load(dev_pages(dev), index);
+    if (curr == NULL || curr->page == NULL) {
+      /* Punched, or compressed once it was unmapped */
+      xa_erase(&dev->crcs, index);
+    } else {
+      page = nth_page(curr->page, index - curr->index);
+      lock_page(page);
+      if (mmap_fault) zap_mappings(dev, index, index);
+      xa_store(&dev->crcs, index, xa_mk_value(page_crc(page)), GFP_KERNEL);
+      xa_clear_mark(&dev->crcs, index, CRC_STALE);
+      unlock_page(page);
+    }
+    unlock_page_range(dev, &range);
+    if (index++ == last) break;
+    cond_resched();
+  }
+}
+
+
+/**
+ * Checksums the pages a shared writable mapping may have changed, once it
+ * is unmapped.
+ */
+static void asgn1_vm_close(struct vm_area_struct *vma)
+{
+  asgn1_dev *dev = vma->vm_file->private_data;
+
+  if (!checksum || (vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) !=
+      (VM_SHARED | VM_MAYWRITE))
+    return;
+  down_read(&dev->sem);
+  settle_crcs(dev, vma->vm_pgoff, vma->vm_pgoff + vma_pages(vma) - 1);
+  up_read(&dev->sem);
+}
+
+
+static const struct vm_operations_struct asgn1_vm_ops = {
+  .fault = asgn1_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+  .huge_fault = asgn1_vm_huge_fault,
+#endif
+  .page_mkwrite = asgn1_vm_page_mkwrite,
+  .close = asgn1_vm_close,
+};
+
+/* Remapped pages need no faults, only their checksums settled on unmap */
+static const struct vm_operations_struct asgn1_remap_vm_ops = {
+  .close = asgn1_vm_close,
+};
+
+/**
+ * The pages handed out by asgn1_vm_fault belong to the mapping of the
+ * device. A store through a shared mapping, or zapping one which was
+ * stored to, marks them dirty. There is nothing to write them back to,
+ * so only the flag is set.
+ */
+static const struct address_space_operations asgn1_aops = {
+  .dirty_folio = noop_dirty_folio,
+};
+
+
+/**
+ * Checksums the pages of [start, end] written through a mapping so far, so
+ * a scrub checks them too.
+ */
+static int asgn1_fsync(struct file *filp, loff_t start, loff_t end,
+    int datasync) {
+  asgn1_dev *dev = filp->private_data;
+
+  if (!checksum || end < start) return 0;
+  down_read(&dev->sem);
+  settle_crcs(dev, start >> PAGE_SHIFT, end >> PAGE_SHIFT);
+  up_read(&dev->sem);
+  return 0;
+}
+
+
+/**
+ * Creates a new mapping in the virtual address space of the calling process.
+ */
+static int asgn1_mmap (struct file *filp, struct vm_area_struct *vma)
+{
+  asgn1_dev *dev = filp->private_data;
+  /* offset is in pages, not bytes */
+  unsigned long offset = vma->vm_pgoff;
+  unsigned long len = vma->vm_end - vma->vm_start;
+  unsigned long npages = len >> PAGE_SHIFT;
+  page_node *curr;
+  unsigned long index = 0;
+  unsigned long nr;
+  int result = 0;
+  u64 start = ktime_get_ns();
+
+  /* The values of a key-value store are read in place, never written */
+  if (kv) {
+    if (vma->vm_flags & VM_WRITE) return -EACCES;
+    vm_flags_clear(vma, VM_MAYWRITE);
+  }
+
+  /* Nothing is mapped up front, pages are found (or grown) by asgn1_vm_fault
+   * as they are touched */
+  if (mmap_fault) {
+    vma->vm_ops = &asgn1_vm_ops;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    /* Let PMD sized extents be mapped whole even if THP is only on for
+     * madvise */
+    if (extent_order >= HPAGE_PMD_ORDER) vm_flags_set(vma, VM_HUGEPAGE);
+#endif
+    trace_asgn1_mmap(dev->dev, (loff_t)offset << PAGE_SHIFT, len, 0, 0,
+        ktime_get_ns() - start);
+    return 0;
+  }
+
+  wait_restored(dev, ULONG_MAX);
+  down_read(&dev->sem);
+  /* Stores to remapped pages can't be seen coming to copy them first */
+  if (!list_empty(&dev->snapshots)) {
+    result = -EBUSY;
+    goto out;
+  }
+  /* check that they don't want to map past the data that we have */
+  if (offset + npages > DIV_ROUND_UP(dev->data_size, PAGE_SIZE)) {
+    printk(KERN_WARNING "Attempting to map past available memory\n");
+    result = -EINVAL;
+    goto out;
+  }
+  /* Stores to remapped pages can't be seen either, so their checksums are
+   * only taken again once they are unmapped */
+  vma->vm_ops = &asgn1_remap_vm_ops;
+  if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) == (VM_SHARED | VM_MAYWRITE)) {
+    result = mark_crcs_stale(dev, offset, offset + npages - 1);
+    if (result < 0) goto out;
+  }
 
-static struct proc_dir_entry *proc_entry;
+  /* Only map the relevant range of pages. Holes need a real page behind
+   * them before they can be remapped */
+  for (index = 0; index < npages; index += nr) {
+    curr = xa_load(dev_pages(dev), offset + index);
+    if (curr == NULL) curr = alloc_page_node(dev, offset + index);
+    if (IS_ERR(curr)) {
+      result = PTR_ERR(curr);
+      goto out;
+    }
+    /* An extent is physically contiguous, so it is remapped in one go */
+    nr = min(curr->index + (1UL << curr->order) - (offset + index),
+        npages - index);
+    if (remap_pfn_range(vma, vma->vm_start + PAGE_SIZE * index,
+          page_to_pfn(curr->page) + (offset + index - curr->index),
+          nr * PAGE_SIZE, vma->vm_page_prot)) {
+      result = -EAGAIN;
+      goto out;
+    }
+  }
 
-int asgn1_major = 0;                      /* major number of module */  
-int asgn1_minor = 0;                      /* minor number of module */
-int asgn1_dev_count = 1;                  /* number of devices */
+out:
+  up_read(&dev->sem);
+  trace_asgn1_mmap(dev->dev, (loff_t)offset << PAGE_SHIFT, len, index, result,
+      ktime_get_ns() - start);
+  return result;
+}
+
+
+struct file_operations asgn1_fops = {
+  .owner = THIS_MODULE,
+  .read_iter = asgn1_read_iter,
+  .write_iter = asgn1_write_iter,
+  .splice_read = asgn1_splice_read,
+  .splice_write = iter_file_splice_write,
+  .unlocked_ioctl = asgn1_ioctl,
+  .open = asgn1_open,
+  .mmap = asgn1_mmap,
+  .release = asgn1_release,
+  .fsync = asgn1_fsync,
+  .llseek = asgn1_lseek,
+  .fallocate = asgn1_fallocate,
+  /* lines mappings up with PMDs, so extents can be mapped whole */
+  .get_unmapped_area = thp_get_unmapped_area
+};
 
 
 /**
- * This function frees all memory pages held by the module.
+ * This function compresses the page of curr, replacing it in the page index,
+ * unless it is mapped, in use or hardly compressible. The caller must hold
+ * dev->sem for reading and the page locked for writing. Memory is allocated
+ * with gfp, and the page is left as it is if that fails. Returns whether the
+ * page was freed.
  */
-void free_memory_pages(void) {
-  page_node *curr;
-  struct list_head *ptr;
-  struct list_head *tmp;
+static bool compress_page_node(asgn1_dev *dev, page_node *curr, gfp_t gfp) {
+  struct folio *folio = page_folio(curr->page);
+  struct crypto_wait wait;
+  struct scatterlist src, dst;
+  page_node *new;
+  int result;
+
+  /* The scan and the shrinker don't wait for each other */
+  if (!mutex_trylock(&asgn1_comp_lock)) return false;
+  /* A fault installing the page in a mapping holds the page lock */
+  if (!folio_trylock(folio)) {
+    mutex_unlock(&asgn1_comp_lock);
+    return false;
+  }
+  /* Only the page index may hold a reference */
+  if (folio_mapped(folio) || folio_ref_count(folio) != 1) goto out;
+  /* A page nobody has matched yet is compressed instead */
+  if (curr->shared && !detach_shared_page(dev, curr)) goto out;
 
-  /* Loop through the page list */
-  list_for_each_safe(ptr, tmp, &asgn1_device.mem_list) {
-    /* If a page has been allocated, free it. The list node is then deleted */
-    curr = list_entry(ptr, page_node, list);
-    if (curr->page) 
-      __free_page(curr->page);
-    list_del(&curr->list);
-    kfree(curr);
+  crypto_init_wait(&wait);
+  sg_init_table(&src, 1);
+  sg_set_page(&src, curr->page, PAGE_SIZE, 0);
+  sg_init_one(&dst, asgn1_comp_buf, PAGE_SIZE);
+  acomp_request_set_params(asgn1_comp_req, &src, &dst, PAGE_SIZE, PAGE_SIZE);
+  acomp_request_set_callback(asgn1_comp_req, CRYPTO_TFM_REQ_MAY_SLEEP,
+      crypto_req_done, &wait);
+  result = crypto_wait_req(crypto_acomp_compress(asgn1_comp_req), &wait);
+  /* Keeping a page which barely compresses isn't worth decompressing it */
+  if (result < 0 || asgn1_comp_req->dlen > PAGE_SIZE * 3 / 4) goto out;
+
+  new = new_page_node(dev, gfp);
+  if (new == NULL) goto out;
+  new->zdata = kmemdup(asgn1_comp_buf, asgn1_comp_req->dlen, gfp);
+  if (new->zdata == NULL) goto out_free;
+  new->zlen = asgn1_comp_req->dlen;
+  new->page = NULL;
+  new->index = curr->index;
+  new->order = 0;
+  new->referenced = false;
+  new->shared = NULL;
+  new->flags = 0;
+  new->gen = curr->gen;
+
+  if (xa_is_err(xa_store(dev_pages(dev), curr->index, new, gfp))) {
+    kfree(new->zdata);
+    goto out_free;
   }
+  atomic_long_inc(&dev->comp_pages);
+  atomic_long_add(new->zlen, &dev->comp_bytes);
+  mutex_unlock(&asgn1_comp_lock);
+  folio_unlock(folio);
+  free_page_node(dev, curr);
+  return true;
 
-  /* Reset the number of pages and data size to 0 since there is nothing in the driver
-   * anymore */
-  asgn1_device.num_pages = 0;
-  asgn1_device.data_size = 0;
+out_free:
+  kfree(new);
+out:
+  mutex_unlock(&asgn1_comp_lock);
+  folio_unlock(folio);
+  return false;
 }
 
 
 /**
- * This function opens the virtual disk, if it is opened in the write-only
- * mode, all memory pages will be freed.
+ * This function turns the page of curr into a hole if it is all zeros, or
+ * else shares it with an identical page of the device. A page with no match
+ * yet is entered in the dedup hash table for later ones to find. Mapped
+ * pages and pages in use are left alone. The caller must hold dev->sem for
+ * reading and the page locked for writing. Memory is allocated with gfp, as
+ * in compress_page_node. Returns whether the page was freed.
  */
-int asgn1_open(struct inode *inode, struct file *filp) {
+static bool dedup_page_node(asgn1_dev *dev, page_node *curr, gfp_t gfp) {
+  struct folio *folio = page_folio(curr->page);
+  void *addr = page_address(curr->page);
+  shared_page *shared, *new_shared;
+  page_node *new;
+  u64 hash_val;
 
-  /* Increment the process count and check it's not greater than
-   * the maximum allowed procs. If it is then decrement it back
-   * to what it was and return EBUSY. */
-  atomic_inc(&asgn1_device.nprocs);
-  if (atomic_read(&asgn1_device.nprocs) >
-      atomic_read(&asgn1_device.max_nprocs)) {
-    atomic_dec(&asgn1_device.nprocs);
-    return -EBUSY;
+  if (!folio_trylock(folio)) return false;
+  if (folio_mapped(folio) || folio_ref_count(folio) != 1) goto out;
+
+  /* Reads of a hole return zeros just the same */
+  if (memchr_inv(addr, 0, PAGE_SIZE) == NULL) {
+    xa_erase(dev_pages(dev), curr->index);
+    forget_crcs(dev, curr->index, curr->index);
+    folio_unlock(folio);
+    free_page_node(dev, curr);
+    atomic_long_inc(&dev->zero_pages);
+    return true;
   }
 
-  if (filp->f_flags & O_APPEND) filp->f_pos = asgn1_device.data_size;
+  hash_val = xxh64(addr, PAGE_SIZE, 0);
+  new = new_page_node(dev, gfp);
+  new_shared = kmalloc(sizeof(shared_page), gfp);
+  if (new == NULL || new_shared == NULL) goto out_free;
 
-  /* Only truncate the file if it is opened for writing, and is expected
-   * to be truncated */
-  if (filp->f_flags & O_TRUNC &&
-      filp->f_flags & O_WRONLY) free_memory_pages();
+  spin_lock(&dev->dedup_lock);
+  hash_for_each_possible(dev->dedup_hash, shared, hash, hash_val) {
+    if (shared->hash_val == hash_val &&
+        memcmp(page_address(shared->page), addr, PAGE_SIZE) == 0)
+      break;
+  }
+  if (shared == NULL) {
+    new_shared->hash_val = hash_val;
+    new_shared->page = curr->page;
+    new_shared->sharers = 1;
+    hash_add(dev->dedup_hash, &new_shared->hash, hash_val);
+    spin_unlock(&dev->dedup_lock);
+    curr->shared = new_shared;
+    kfree(new);
+    goto out;
+  }
+  /* The sharers hold the page, so it can't go before it is taken here */
+  shared->sharers++;
+  get_page(shared->page);
+  spin_unlock(&dev->dedup_lock);
+  atomic_long_inc(&dev->dedup_saved);
+  kfree(new_shared);
 
-  return 0; /* success */
+  new->page = shared->page;
+  new->index = curr->index;
+  new->order = 0;
+  new->referenced = false;
+  new->zdata = NULL;
+  new->zlen = 0;
+  new->shared = shared;
+  new->flags = 0;
+  new->gen = curr->gen;
+  if (xa_is_err(xa_store(dev_pages(dev), curr->index, new, gfp))) {
+    leave_shared_page(dev, new);
+    put_page(new->page);
+    kfree(new);
+    goto out;
+  }
+  folio_unlock(folio);
+  free_page_node(dev, curr);
+  return true;
+
+out_free:
+  kfree(new_shared);
+  kfree(new);
+out:
+  folio_unlock(folio);
+  return false;
 }
 
 
 /**
- * This function releases the virtual disk, but nothing needs to be done
- * in this case. 
+ * The cold page scan, run every SCAN_PERIOD. A page is cold when it hasn't
+ * been used since the previous scan, like a clock. Cold pages are
+ * deduplicated, and compressed if nothing else shares them by the next
+ * scan. Only single pages are scanned, extents are left alone.
  */
-int asgn1_release (struct inode *inode, struct file *filp) {
-  if (atomic_read(&asgn1_device.nprocs) > 0)
-    atomic_dec(&asgn1_device.nprocs);
-  return 0;
+static void asgn1_scan(struct work_struct *work) {
+  asgn1_dev *dev;
+  page_node *curr;
+  page_range range;
+  unsigned long index;
+  int i;
+
+  for (i = 0; i < asgn1_dev_count; i++) {
+    dev = &asgn1_devices[i];
+    /* Nodes found by the walk may be freed under it, so each one is looked
+     * up again with the page locked before it is used. dev->sem keeps a
+     * reset from swapping the page index out under the walk */
+    index = 0;
+    down_read(&dev->sem);
+    curr = xa_find(dev_pages(dev), &index, ULONG_MAX, XA_PRESENT);
+    while (curr) {
+      lock_page_range(dev, &range, (loff_t)index << PAGE_SHIFT, PAGE_SIZE,
+          true);
+      curr = xa_load(dev_pages(dev), index);
+      /* Preallocated pages stay as they are until they are written to */
+      if (curr && curr->page && curr->order == 0 &&
+          !test_bit(NODE_RESERVED, &curr->flags)) {
+        if (READ_ONCE(curr->referenced)) WRITE_ONCE(curr->referenced, false);
+        else if (dedup && curr->shared == NULL)
+          dedup_page_node(dev, curr, GFP_KERNEL);
+        else if (asgn1_comp_tfm) compress_page_node(dev, curr, GFP_KERNEL);
+      }
+      unlock_page_range(dev, &range);
+      up_read(&dev->sem);
+      cond_resched();
+      down_read(&dev->sem);
+      curr = xa_find_after(dev_pages(dev), &index, ULONG_MAX, XA_PRESENT);
+    }
+    up_read(&dev->sem);
+  }
+  schedule_delayed_work(&asgn1_scan_work, SCAN_PERIOD);
 }
 
 
+/* Reclaim mustn't recurse into reclaim, nor wait for memory it is freeing */
+#define SHRINK_GFP (GFP_NOWAIT | __GFP_NOWARN)
+
 /**
- * This function reads contents of the virtual disk and writes to the user space.
+ * This function reclaims memory from the device for the shrinker, looking
+ * at up to nr_to_scan page nodes from where it stopped last time. Cold
+ * pages are deduplicated or compressed when that is on. Preallocated pages
+ * are left alone, as writes to them must not allocate. It never sleeps on
+ * a lock, since the caller may be an allocation in the ramdisk itself, and
+ * gives up on a page if the memory to replace it can't be had at once.
+ * Returns the pages freed.
  */
-ssize_t asgn1_read(struct file *filp, char __user *buf, size_t count,
-    loff_t *f_pos) {
-  size_t size_read = 0;     /* size read from virtual disk in this function */
-  size_t begin_offset;      /* the offset from the beginning of a page to
-                               start reading */
-  int begin_page_no = (*f_pos - 1) / PAGE_SIZE; /* the first page which contains
-                                             the requested data */
-
-  /* Subtract 1 to stop it from grabbing one extra page in the case that it
-   * is reading an exact page */
-  int final_page_no;
-  int curr_page_no = 0;     /* the current page number */
-  size_t curr_size_read;    /* size read from the virtual disk in this round */
-  size_t size_to_be_read;   /* size to be read in the current round in 
-                               while loop */
-  size_t size_not_read;
-
+static unsigned long shrink_device(asgn1_dev *dev, unsigned long nr_to_scan) {
+  unsigned long index = READ_ONCE(dev->shrink_index);
+  unsigned long next;
+  unsigned long freed = 0;
   page_node *curr;
+  page_range range;
 
-  if (*f_pos >= asgn1_device.data_size) return 0;
-  if (*f_pos + count > asgn1_device.data_size) count = asgn1_device.data_size-*f_pos;
-  final_page_no= (*f_pos - 1 + count) / PAGE_SIZE; /* get the final page num. 1 is subtracted to prevent
-                                                      cases that need an exact page amount from getting
-                                                      one too many pages */
-  list_for_each_entry(curr, &asgn1_device.mem_list, list) {
-    if (begin_page_no <= curr_page_no && curr_page_no <= final_page_no) {
-      if (curr->page == NULL) {
-        printk(KERN_WARNING "Attempting to read an unallocated page\n");
-        return -1;
-      }
+  if (!down_read_trylock(&dev->sem)) return 0;
+  while (nr_to_scan--) {
+    if (xa_find(dev_pages(dev), &index, ULONG_MAX, XA_PRESENT) == NULL) {
+      index = 0;
+      break;
+    }
+    /* Lock the largest extent there could be around the node before
+     * looking at it */
+    range.first = round_down(index, 1UL << extent_order);
+    range.last = range.first + (1UL << extent_order) - 1;
+    range.write = true;
+    next = range.last + 1;
+    if (!try_lock_page_range(dev, &range)) {
+      index = next;
+      continue;
+    }
 
-      begin_offset = *f_pos % PAGE_SIZE;
-      size_to_be_read = min((long)count - size_read, (long)PAGE_SIZE - begin_offset);
+    curr = xa_load(dev_pages(dev), index);
+    if (curr && curr->page) {
+      next = curr->index + (1UL << curr->order);
+      if (test_bit(NODE_RESERVED, &curr->flags) || curr->order ||
+          (!dedup && !asgn1_comp_tfm))
+        ;
+      else if (READ_ONCE(curr->referenced)) WRITE_ONCE(curr->referenced, false);
+      else if (dedup && curr->shared == NULL)
+        freed += dedup_page_node(dev, curr, SHRINK_GFP);
+      else if (asgn1_comp_tfm)
+        freed += compress_page_node(dev, curr, SHRINK_GFP);
+    }
+    unlock_page_range(dev, &range);
+    index = next;
+  }
+  WRITE_ONCE(dev->shrink_index, index);
+  up_read(&dev->sem);
+  return freed;
+}
 
-      size_not_read = copy_to_user(buf + size_read,
-          page_address(curr->page) + begin_offset,
-          size_to_be_read);
 
-      /* Update the file position and the total amount read. If the copy was
-       * not successful then break out of the loop to prevent any more reads.
-       * The user can recall the read function to complete it. */
-      curr_size_read = size_to_be_read - size_not_read;
-      *f_pos += curr_size_read;
-      size_read += curr_size_read;
+static unsigned long asgn1_shrink_count(struct shrinker *shrinker,
+    struct shrink_control *sc) {
+  unsigned long count = pool_count();
+  int i;
 
-      /* If we didn't read all we wanted to this iteration, stop reading and
-       * return what we have read so far. */
-      if (size_not_read) break;
-    }
-    curr_page_no++;
+  if (dedup || asgn1_comp_tfm) {
+    for (i = 0; i < asgn1_dev_count; i++)
+      count += max_t(long, 0, atomic_long_read(&asgn1_devices[i].num_pages) -
+          atomic_long_read(&asgn1_devices[i].reserved_pages));
   }
-  //printk(KERN_WARNING "%s: %d bytes read\n", MYDEV_NAME, size_read);
-  filp->f_pos = *f_pos;
-  /* If the read function wasn't able to read anything then return an error */
-  return (size_read > 0) ? size_read : -EFAULT;
+  return count ?: SHRINK_EMPTY;
 }
 
+
+static unsigned long asgn1_shrink_scan(struct shrinker *shrinker,
+    struct shrink_control *sc) {
+  unsigned long freed;
+  int i;
+
+  /* Pages kept ready for writes go before any holding data */
+  freed = pool_shrink(sc->nr_to_scan);
+  for (i = 0; i < asgn1_dev_count && freed < sc->nr_to_scan; i++)
+    freed += shrink_device(&asgn1_devices[i], sc->nr_to_scan - freed);
+  return freed ?: SHRINK_STOP;
+}
+
+
 /**
- * This function repositions the offset of the open file associated with the 
- * file descriptor fd. */
-static loff_t asgn1_lseek (struct file *file, loff_t offset, int cmd)
-{
-  loff_t testpos;
-  size_t buffer_size = asgn1_device.num_pages * PAGE_SIZE;
+ * Allocates the compressor named by the compress parameter, if any.
+ */
+static int asgn1_setup_compress(void) {
+  if (compress == NULL || *compress == '\0') return 0;
 
-  switch (cmd) {
-    case SEEK_SET:
-      testpos = offset;
-      break;
-    case SEEK_CUR:
-      testpos = file->f_pos + offset;
-      break;
-    case SEEK_END:
-      testpos = asgn1_device.data_size - offset;
-      break;
-    default:
-      printk(KERN_WARNING "%s: Invalid cmd given to asgn1_lseek.\n", MYDEV_NAME);
-      return -EINVAL;
+  asgn1_comp_tfm = crypto_alloc_acomp(compress, 0, 0);
+  if (IS_ERR(asgn1_comp_tfm)) {
+    printk(KERN_WARNING "%s: Unknown compression algorithm %s\n",
+        MYDEV_NAME, compress);
+    return PTR_ERR(asgn1_comp_tfm);
   }
+  asgn1_comp_req = acomp_request_alloc(asgn1_comp_tfm);
+  asgn1_comp_buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+  if (asgn1_comp_req == NULL || asgn1_comp_buf == NULL) {
+    kfree(asgn1_comp_buf);
+    if (asgn1_comp_req) acomp_request_free(asgn1_comp_req);
+    crypto_free_acomp(asgn1_comp_tfm);
+    return -ENOMEM;
+  }
+  return 0;
+}
 
-  if (testpos < 0) testpos = 0;
-  else if (testpos > buffer_size) testpos = buffer_size;
 
-  file->f_pos = testpos;
-  return testpos;
+/**
+ * Frees the compressor.
+ */
+static void asgn1_cleanup_compress(void) {
+  if (asgn1_comp_tfm == NULL) return;
+  kfree(asgn1_comp_buf);
+  acomp_request_free(asgn1_comp_req);
+  crypto_free_acomp(asgn1_comp_tfm);
+  asgn1_comp_tfm = NULL;
 }
 
 
 /**
- * This function writes from the user buffer to the virtual disk of this
- * module.
+ * Creates the cache of page nodes and, unless pool_size is 0, the per CPU
+ * pools, which are filled up on first use. Page nodes are freed with
+ * kfree() like any other slab object.
  */
-ssize_t asgn1_write(struct file *filp, const char __user *buf, size_t count,
-    loff_t *f_pos) {
-  size_t orig_f_pos = *f_pos;  /* the original file position */
-  size_t size_written = 0;  /* size written to virtual disk in this function */
-  size_t begin_offset;  /* the offset from the beginning of a page to
-                           start writing */
-  int begin_page_no = (*f_pos - 1) / PAGE_SIZE;  /* the first page this function 
-                                              should start writing to */
-  int final_page_no = (*f_pos - 1 + count) / PAGE_SIZE; /* index of the last
-                                                           page which will be
-                                                           written to */
-  int curr_page_no = 0;     /* the current page number */
-  size_t curr_size_written; /* size written to virtual disk in this round */
-  size_t size_to_be_written;  /* size to be read in the current round in 
-                                 while loop */
-  size_t size_not_written;
+static int asgn1_setup_pool(void) {
+  asgn1_pool *pool;
+  int cpu;
 
-  page_node *curr;
+  asgn1_node_cache = kmem_cache_create("asgn1_node", sizeof(page_node), 0, 0,
+      NULL);
+  if (asgn1_node_cache == NULL) return -ENOMEM;
+
+  pool_size = min_t(unsigned int, pool_size, POOL_MAX);
+  if (pool_size == 0) return 0;
+  asgn1_pools = alloc_percpu(asgn1_pool);
+  if (asgn1_pools == NULL) {
+    kmem_cache_destroy(asgn1_node_cache);
+    return -ENOMEM;
+  }
+  for_each_possible_cpu(cpu) {
+    pool = per_cpu_ptr(asgn1_pools, cpu);
+    spin_lock_init(&pool->lock);
+    INIT_WORK(&pool->refill, pool_refill);
+    pool->cpu = cpu;
+  }
+  return 0;
+}
 
 
-  /* Allocate all the pages we are going to need and add 
-   * them to the list of memory pages */
-  while (asgn1_device.num_pages <= final_page_no) {
-    curr = kmalloc(sizeof(page_node), GFP_KERNEL);
-    if (curr == NULL) {
-      printk(KERN_WARNING "%s: Not enough memory to allocate anymore pages\n", MYDEV_NAME);
-      return -ENOMEM;
-    }
-    curr->page = alloc_page(GFP_KERNEL);
-    if (curr->page == NULL) {
-      printk(KERN_WARNING "%s: Not enough memory to allocate anymore pages\n", MYDEV_NAME);
-      return -ENOMEM;
+/**
+ * Frees the pools and the cache of page nodes, once every page node has
+ * been freed.
+ */
+static void asgn1_cleanup_pool(void) {
+  asgn1_pool *pool;
+  int cpu;
+
+  if (asgn1_pools) {
+    for_each_possible_cpu(cpu) {
+      pool = per_cpu_ptr(asgn1_pools, cpu);
+      cancel_work_sync(&pool->refill);
+      while (pool->nr_pages) __free_page(pool->pages[--pool->nr_pages]);
+      kmem_cache_free_bulk(asgn1_node_cache, pool->nr_nodes,
+          (void **) pool->nodes);
     }
-    list_add_tail(&(curr->list), &asgn1_device.mem_list);
-    asgn1_device.num_pages++;
+    free_percpu(asgn1_pools);
+    asgn1_pools = NULL;
   }
+  kmem_cache_destroy(asgn1_node_cache);
+}
 
-  list_for_each_entry(curr, &asgn1_device.mem_list, list) {
-    /* Only write on the relevant pages */
-    if (begin_page_no <= curr_page_no && curr_page_no <= final_page_no) {
-      if (curr->page == NULL) {
-        printk(KERN_INFO "%s: Trying to write to an unallocated page\n", MYDEV_NAME);
-        return -1;
-      }
-      /* Get the offset for this iteration */
-      begin_offset = *f_pos % PAGE_SIZE;
-      /* Make sure the size we are about to write fits within a page */
-      size_to_be_written = min((long) count - size_written, (long) PAGE_SIZE - begin_offset);
 
-      size_not_written = copy_from_user(page_address(curr->page) + begin_offset,
-          buf + size_written,
-          size_to_be_written);
+/**
+ * This function copies the data of a read or write request between its
+ * bio segments and the ramdisk pages, through the same paths as the
+ * character device. Reads past the end of the data written so far return
+ * zeros, as holes do. Any other short read fails the request, with
+ * BLK_STS_RESOURCE if a compressed page couldn't be decompressed.
+ */
+static blk_status_t asgn1_blk_rw(asgn1_dev *dev, struct request *rq) {
+  loff_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+  struct req_iterator iter;
+  struct bio_vec bvec;
+  struct iov_iter bv_iter;
+  ssize_t result;
 
-      /* Update the file position and the total amount written. If the copy was
-       * not successful then break out of the loop to prevent any more writes.
-       * The user can recall the write function to complete it. */
-      curr_size_written = size_to_be_written - size_not_written;
-      *f_pos += curr_size_written;
-      size_written += curr_size_written;
-      if (size_not_written) break;
+  rq_for_each_segment(bvec, rq, iter) {
+    if (rq_data_dir(rq) == WRITE) {
+      iov_iter_bvec(&bv_iter, ITER_SOURCE, &bvec, 1, bvec.bv_len);
+      result = asgn1_do_write(dev, &pos, &bv_iter);
+      if (result < 0) return errno_to_blk_status(result);
+      if (iov_iter_count(&bv_iter)) return BLK_STS_IOERR;
+    } else {
+      iov_iter_bvec(&bv_iter, ITER_DEST, &bvec, 1, bvec.bv_len);
+      while (iov_iter_count(&bv_iter)) {
+        if (pos >= READ_ONCE(dev->data_size)) {
+          pos += iov_iter_zero(iov_iter_count(&bv_iter), &bv_iter);
+          break;
+        }
+        result = asgn1_do_read(dev, &pos, &bv_iter);
+        if (result == -ENOMEM) return BLK_STS_RESOURCE;
+        if (result < 0) return BLK_STS_IOERR;
+      }
     }
-    curr_page_no++;
   }
+  return BLK_STS_OK;
+}
 
-  filp->f_pos = *f_pos;
-  asgn1_device.data_size = max(asgn1_device.data_size,
-      orig_f_pos + size_written);
-  //printk(KERN_INFO "%s: %d bytes written\n", MYDEV_NAME, size_written);
-  /* If the write function wasn't able to write anything then return an error */
-  return (size_written > 0) ? size_written : -EFAULT;
+
+/**
+ * This function serves a request of the block device. Requests are served
+ * straight from the submitting CPU's hardware context, so disk I/O from
+ * different CPUs runs in parallel under the same range locks as the
+ * character device. Discards punch holes.
+ */
+static blk_status_t asgn1_queue_rq(struct blk_mq_hw_ctx *hctx,
+    const struct blk_mq_queue_data *bd) {
+  struct request *rq = bd->rq;
+  asgn1_dev *dev = rq->q->queuedata;
+  blk_status_t status = BLK_STS_OK;
+  u64 start;
+
+  blk_mq_start_request(rq);
+  switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+      start = ktime_get_ns();
+      status = asgn1_blk_rw(dev, rq);
+      account_io(dev, rq_data_dir(rq) == WRITE,
+          blk_rq_pos(rq) << SECTOR_SHIFT, blk_rq_bytes(rq),
+          status ? -EIO : blk_rq_bytes(rq), start);
+      break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+      status = errno_to_blk_status(punch_hole(dev,
+          blk_rq_pos(rq) << SECTOR_SHIFT, blk_rq_bytes(rq)));
+      break;
+    case REQ_OP_FLUSH:
+      /* everything written is already in memory */
+      break;
+    default:
+      status = BLK_STS_NOTSUPP;
+  }
+  blk_mq_end_request(rq, status);
+  return BLK_STS_OK;
 }
 
-#define SET_NPROC_OP 1
-#define TEM_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int) 
 
-#define GET_CUR_PROCS_OP 2
-#define TEM_GET_CUR_PROCS _IOR(MYIOC_TYPE, GET_CUR_PROCS_OP, int)
+static const struct blk_mq_ops asgn1_mq_ops = {
+  .queue_rq = asgn1_queue_rq,
+};
+
+static const struct block_device_operations asgn1_bdev_ops = {
+  .owner = THIS_MODULE,
+};
 
-#define RESET_DEVICE_OP 3
-#define TEM_RESET_DEVICE _IO(MYIOC_TYPE, RESET_DEVICE_OP)
 
 /**
- * The ioctl function, which nothing needs to be done in this case.
- * This module supports 3 options by giving it the following commands:
- * 1 - The integer you pass with be used to set the new max processes allowed.
- *     You cannot set it to a number lower than the current amount of processes.
- *
- * 2 - Can be used to retrive the current amount of processes using the device.
- * 3 - Can be used to free all of the memory pages used by the device.
+ * Exports ramdisk i as the block device asgn1b<i> as well, with one hardware
+ * queue per CPU. The disk shares the pages of the character device, but has
+ * a page cache of its own, so a filesystem on the disk must not be written
+ * through the character device at the same time.
  */
-long asgn1_ioctl (struct file *filp, unsigned cmd, unsigned long arg) {
-  int nr;
-  int new_nprocs;
-  int pages_allocated;
+static int asgn1_setup_disk(asgn1_dev *dev, int i) {
+  struct queue_limits lim = {
+    .physical_block_size = PAGE_SIZE,
+    .max_hw_discard_sectors = UINT_MAX,
+    .discard_granularity = PAGE_SIZE,
+    .max_write_zeroes_sectors = UINT_MAX,
+  };
+  struct gendisk *disk;
   int result;
 
-  if (_IOC_TYPE(cmd) != MYIOC_TYPE) return -EINVAL;
-  nr = _IOC_NR(cmd);
+  dev->tag_set.ops = &asgn1_mq_ops;
+  dev->tag_set.nr_hw_queues = num_possible_cpus();
+  dev->tag_set.queue_depth = 128;
+  dev->tag_set.numa_node = NUMA_NO_NODE;
+  /* the handlers take the device locks and allocate pages */
+  dev->tag_set.flags = BLK_MQ_F_BLOCKING;
+  result = blk_mq_alloc_tag_set(&dev->tag_set);
+  if (result < 0) return result;
 
-  switch (nr) {
-    case SET_NPROC_OP:
-      result = get_user(new_nprocs, (int *) arg);
-      if (result) {
-        printk(KERN_WARNING "%s: Error when retriving the new nprocs value\n", MYDEV_NAME);
-        return -EINVAL;
-      }
-      if (new_nprocs < atomic_read(&asgn1_device.nprocs)) return -EINVAL;
-      atomic_set(&asgn1_device.max_nprocs, new_nprocs);
-      return 0;
-    case GET_CUR_PROCS_OP:
-      pages_allocated = atomic_read(&asgn1_device.nprocs);
-      result = put_user(pages_allocated, (int *) arg);
-      if (result) {
-        printk(KERN_WARNING
-            "%s: Error when copying the procs value to userspace\n", MYDEV_NAME);
-        return -EINVAL;
-      }
-      return 0;
-    case RESET_DEVICE_OP:
-      if (atomic_read(&asgn1_device.nprocs) > 1) return -EINVAL;
-      free_memory_pages();
-      return 0;
-    default:
-      printk(KERN_WARNING "ioctl command doesn't match any available\n");
-      return -EINVAL;
+  disk = blk_mq_alloc_disk(&dev->tag_set, &lim, dev);
+  if (IS_ERR(disk)) {
+    result = PTR_ERR(disk);
+    goto fail_disk;
   }
+  disk->major = asgn1_blk_major;
+  disk->first_minor = i;
+  disk->minors = 1;
+  disk->fops = &asgn1_bdev_ops;
+  disk->private_data = dev;
+  snprintf(disk->disk_name, DISK_NAME_LEN, "%sb%d", MYDEV_NAME, i);
+  set_capacity(disk, (sector_t)disk_size << (20 - SECTOR_SHIFT));
+
+  result = add_disk(disk);
+  if (result < 0) {
+    printk(KERN_WARNING "%s: Unable to add disk %d\n", MYDEV_NAME, i);
+    goto fail_add;
+  }
+  dev->disk = disk;
+  return 0;
+
+fail_add:
+  put_disk(disk);
+fail_disk:
+  blk_mq_free_tag_set(&dev->tag_set);
+  return result;
 }
 
 
 /**
- * Displays information about current status of the module,
- * which helps debugging. This message will tell the caller
- * how many bytes they have written to the device, how much 
- * space it has been currently allocated.
+ * Removes the block device of a ramdisk, waiting for its requests to finish.
  */
-int asgn1_read_procmem(char *buf, char **start, off_t offset, int count,
-    int *eof, void *data) {
-  int result;
-  /* 65 is the largest amount of space this print statement can take up */
-  if (60 > count) {
-    printk(KERN_WARNING "%s: Buffer provided needs to have 60 or more bytes of space\n", MYDEV_NAME);
-    return -EINVAL;
-  }
-  result =
-      sprintf(buf, "Bytes written: %d, Total allocated space in bytes: %ld\n",
-      asgn1_device.data_size, PAGE_SIZE * asgn1_device.num_pages);
-  *eof = 1;
-  return result;
+static void asgn1_cleanup_disk(asgn1_dev *dev) {
+  if (dev->disk == NULL) return;
+  del_gendisk(dev->disk);
+  put_disk(dev->disk);
+  blk_mq_free_tag_set(&dev->tag_set);
+  dev->disk = NULL;
 }
 
 
 /**
- * Creates a new mapping in the virtual address space of the calling process.
+ * Sets up the ramdisk for minor number asgn1_minor + i and creates its
+ * /dev/asgn1<i> node.
  */
-static int asgn1_mmap (struct file *filp, struct vm_area_struct *vma)
-{
-  /* offset is in pages, not bytes */
-  unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-  unsigned long len = vma->vm_end - vma->vm_start;
-  unsigned long ramdisk_size = asgn1_device.num_pages * PAGE_SIZE;
-  page_node *curr;
-  unsigned long index = 0;
-  unsigned long endpage = offset + (len / PAGE_SIZE);
+static int asgn1_setup_dev(asgn1_dev *dev, int i) {
+  asgn1_store *store;
+  int class;
+  int result;
 
-  /* check that they don't want to map past memory that we have available */
-  if ((offset * PAGE_SIZE) + len > ramdisk_size) {
-    printk(KERN_WARNING "Attempting to map past available memory\n");
-    return -EINVAL;
+  dev->dev = MKDEV(asgn1_major, asgn1_minor + i);
+  dev->cache = asgn1_node_cache;
+  atomic_set(&dev->nprocs, 0);
+  atomic_set(&dev->max_nprocs, 1);
+  dev->max_bytes = max_bytes;
+  dev->placement = default_placement;
+  dev->place_node = default_place_node;
+  dev->interleave_node = NUMA_NO_NODE;
+  dev->verify_reads = checksum && verify_reads;
+  init_rwsem(&dev->sem);
+  spin_lock_init(&dev->size_lock);
+  spin_lock_init(&dev->range_lock);
+  spin_lock_init(&dev->dedup_lock);
+  spin_lock_init(&dev->scrub_lock);
+  spin_lock_init(&dev->free_lock);
+  hash_init(dev->dedup_hash);
+  INIT_LIST_HEAD(&dev->ranges);
+  INIT_LIST_HEAD(&dev->snapshots);
+  INIT_LIST_HEAD(&dev->dying);
+  mutex_init(&dev->cow_lock);
+  init_waitqueue_head(&dev->range_wait);
+  init_waitqueue_head(&dev->restore_wait);
+  INIT_WORK(&dev->restore_work, asgn1_restore);
+  INIT_WORK(&dev->scrub_work, asgn1_scrub);
+  INIT_WORK(&dev->free_work, asgn1_free_stores);
+  address_space_init_once(&dev->mapping);
+  dev->mapping.a_ops = &asgn1_aops;
+  init_rwsem(&dev->kv_sem);
+  mutex_init(&dev->kv_alloc_lock);
+  hash_init(dev->kv_hash);
+  xa_init_flags(&dev->kv_ids, XA_FLAGS_ALLOC);
+  for (class = 0; class < KV_CLASSES; class++) xa_init(&dev->kv_free[class]);
+
+  /* Initialise the page index and the checksums of its pages */
+  store = kmalloc(sizeof(asgn1_store), GFP_KERNEL);
+  if (store == NULL) return -ENOMEM;
+  xa_init(&store->pages);
+  RCU_INIT_POINTER(dev->store, store);
+  xa_init(&dev->crcs);
+
+  result = percpu_counter_init(&dev->comp_hits, 0, GFP_KERNEL);
+  if (result < 0) goto fail_store;
+  result = percpu_counter_init(&dev->comp_misses, 0, GFP_KERNEL);
+  if (result < 0) goto fail_counters;
+  dev->stats = alloc_percpu(asgn1_stats);
+  if (dev->stats == NULL) {
+    result = -ENOMEM;
+    goto fail_alloc;
   }
-  list_for_each_entry(curr, &asgn1_device.mem_list, list) {
-    /* Only map the relevant range of pages */
-    if (index >= offset && index < endpage) {
-      if (remap_pfn_range(vma, vma->vm_start + PAGE_SIZE * (index - vma->vm_pgoff),
-            page_to_pfn(curr->page), PAGE_SIZE, vma->vm_page_prot))
-        return -EAGAIN;
-    }
-    index++;
+
+  /* Set up cdev internal structure */
+  dev->cdev = cdev_alloc();
+  if (dev->cdev == NULL) {
+    result = -ENOMEM;
+    goto fail_stats;
+  }
+  dev->cdev->ops = &asgn1_fops;
+  dev->cdev->owner = THIS_MODULE;
+
+  /* Register the device */
+  result = cdev_add(dev->cdev, dev->dev, 1);
+  if (result < 0) {
+    printk(KERN_WARNING "%s: Unable to add cdev %d\n", MYDEV_NAME, i);
+    goto fail_cdev;
+  }
+
+  dev->device = device_create_with_groups(asgn1_class, NULL, dev->dev, dev,
+      asgn1_groups, "%s%d", MYDEV_NAME, i);
+  if (IS_ERR(dev->device)) {
+    printk(KERN_WARNING "%s: can't create udev device %d\n", MYDEV_NAME, i);
+    result = -ENOMEM;
+    goto fail_device;
   }
+
+  if (disk_size) {
+    result = asgn1_setup_disk(dev, i);
+    if (result < 0) goto fail_disk;
+  }
+
+  /* debugfs is only for looking at, so failing to set it up is ignored */
+  dev->debugfs = debugfs_create_dir(dev_name(dev->device), asgn1_debugfs);
+  debugfs_create_file("read_latency", S_IRUGO, dev->debugfs, dev,
+      &read_latency_fops);
+  debugfs_create_file("write_latency", S_IRUGO, dev->debugfs, dev,
+      &write_latency_fops);
   return 0;
+
+fail_disk:
+  device_destroy(asgn1_class, dev->dev);
+fail_device:
+  cdev_del(dev->cdev);
+  dev->cdev = NULL;
+  goto fail_stats;
+fail_cdev:
+  kobject_put(&dev->cdev->kobj);
+  dev->cdev = NULL;
+fail_stats:
+  free_percpu(dev->stats);
+fail_alloc:
+  percpu_counter_destroy(&dev->comp_misses);
+fail_counters:
+  percpu_counter_destroy(&dev->comp_hits);
+fail_store:
+  kfree(store);
+  return result;
 }
 
 
-struct file_operations asgn1_fops = {
-  .owner = THIS_MODULE,
-  .read = asgn1_read,
-  .write = asgn1_write,
-  .unlocked_ioctl = asgn1_ioctl,
-  .open = asgn1_open,
-  .mmap = asgn1_mmap,
-  .release = asgn1_release,
-  .llseek = asgn1_lseek
-};
+/**
+ * Removes the device node of a ramdisk and frees everything it holds.
+ */
+static void asgn1_cleanup_dev(asgn1_dev *dev) {
+  if (dev->cdev == NULL) return;
+  debugfs_remove(dev->debugfs);
+  asgn1_cleanup_disk(dev);
+  device_destroy(asgn1_class, dev->dev);
+  cdev_del(dev->cdev);
+
+  down_write(&dev->kv_sem);
+  kv_forget(dev);
+  up_write(&dev->kv_sem);
+
+  /* Old stores still being freed go first */
+  flush_work(&dev->free_work);
+  down_write(&dev->sem);
+  free_memory_pages(dev);
+  xa_destroy(dev_pages(dev));
+  kfree(rcu_dereference_protected(dev->store, true));
+  up_write(&dev->sem);
+  if (dev->inode) iput(dev->inode);
+  percpu_counter_destroy(&dev->comp_misses);
+  percpu_counter_destroy(&dev->comp_hits);
+  free_percpu(dev->stats);
+}
 
 
 /**
- * Initialise the module and create the master device
+ * Initialise the module and create the devices
  */
 int __init asgn1_init_module(void){
   int result; 
+  int i;
+
+  if (asgn1_dev_count < 1) return -EINVAL;
+  /* Extents are stored as multi-index entries in the page index */
+  if (!IS_ENABLED(CONFIG_XARRAY_MULTI)) extent_order = 0;
+  extent_order = min_t(unsigned int, extent_order, MAX_PAGE_ORDER);
+  /* A page mapped by remap_pfn_range can't be told apart from an unused one */
+  if ((dedup || (compress && *compress)) && !mmap_fault) {
+    printk(KERN_WARNING "%s: compress and dedup need mmap_fault\n", MYDEV_NAME);
+    return -EINVAL;
+  }
+  /* The keys of a key-value store are only kept in memory */
+  if (kv && (disk_size || (backing_file && *backing_file))) {
+    printk(KERN_WARNING "%s: kv can't be used with disk_size or backing_file\n",
+        MYDEV_NAME);
+    return -EINVAL;
+  }
+  if (parse_placement(placement, &default_placement, &default_place_node) < 0) {
+    printk(KERN_WARNING "%s: bad placement %s\n", MYDEV_NAME, placement);
+    return -EINVAL;
+  }
+  INIT_DELAYED_WORK(&asgn1_scan_work, asgn1_scan);
+  if (mmap_fault) {
+    asgn1_hole_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (asgn1_hole_page == NULL) return -ENOMEM;
+  }
+
+  result = asgn1_setup_compress();
+  if (result < 0) goto fail_compress;
+  result = asgn1_setup_pool();
+  if (result < 0) goto fail_pool;
 
-  atomic_set(&asgn1_device.nprocs, 0);
-  atomic_set(&asgn1_device.max_nprocs, 1);
-  result = alloc_chrdev_region(&asgn1_device.dev, asgn1_minor,
+  result = alloc_chrdev_region(&asgn1_devices_dev, asgn1_minor,
       asgn1_dev_count, MYDEV_NAME);
   if (result < 0) {
     printk(KERN_WARNING "%s: Couldn't get a major number\n", MYDEV_NAME);
     goto fail_dev;
   }
   /* Set the major number variable*/
-  asgn1_major = MAJOR(asgn1_device.dev);
+  asgn1_major = MAJOR(asgn1_devices_dev);
   //printk(KERN_INFO "%s: Allocated the major number %d\n", MYDEV_NAME, asgn1_major);
 
-  /* Set up cdev internal structure */
-  asgn1_device.cdev = cdev_alloc();
-  asgn1_device.cdev->ops = &asgn1_fops;
-  asgn1_device.cdev->owner = THIS_MODULE;
-
-  /* Register the device */
-  result = cdev_add(asgn1_device.cdev, asgn1_device.dev, asgn1_dev_count);
-  if (result < 0) {
-    printk(KERN_WARNING "%s: Unable to add cdev\n", MYDEV_NAME);
-    goto fail_cdev;
+  asgn1_devices = kcalloc(asgn1_dev_count, sizeof(asgn1_dev), GFP_KERNEL);
+  if (asgn1_devices == NULL) {
+    result = -ENOMEM;
+    goto fail_alloc;
   }
 
-  /* Initialise the list head */
-  INIT_LIST_HEAD(&asgn1_device.mem_list);
-
-  /* Create the proc entry and add its read method */
-  proc_entry = create_proc_entry(MYPROC_NAME, 0, NULL);
-  if (!proc_entry) {
-    printk(KERN_WARNING "%s: failed making the proc entry\n", MYDEV_NAME);
-    result = -1;
-    goto fail_proc;
-  }
-  //printk(KERN_WARNING "%s: proc created successfully\n", MYDEV_NAME);
-  proc_entry->read_proc = asgn1_read_procmem;
+  /* Statistics are in sysfs, latency histograms in debugfs */
+  asgn1_debugfs = debugfs_create_dir(MYDEV_NAME, NULL);
 
-  asgn1_device.class = class_create(THIS_MODULE, MYDEV_NAME);
-  if (IS_ERR(asgn1_device.class)) {
+  asgn1_class = class_create(MYDEV_NAME);
+  if (IS_ERR(asgn1_class)) {
     printk(KERN_WARNING "%s: can't create class\n", MYDEV_NAME);
     result = -ENOMEM;
     goto fail_class;
   }
 
-  asgn1_device.device = device_create(asgn1_device.class, NULL, 
-      asgn1_device.dev, "%s", MYDEV_NAME);
-  if (IS_ERR(asgn1_device.device)) {
-    printk(KERN_WARNING "%s: can't create udev device\n", MYDEV_NAME);
+  if (disk_size) {
+    asgn1_blk_major = register_blkdev(0, MYDEV_NAME);
+    if (asgn1_blk_major < 0) {
+      printk(KERN_WARNING "%s: Couldn't get a block major number\n", MYDEV_NAME);
+      result = asgn1_blk_major;
+      goto fail_blkdev;
+    }
+  }
+
+  for (i = 0; i < asgn1_dev_count; i++) {
+    result = asgn1_setup_dev(&asgn1_devices[i], i);
+    if (result < 0) goto fail_device;
+  }
+
+  asgn1_shrinker = shrinker_alloc(0, "%s", MYDEV_NAME);
+  if (asgn1_shrinker == NULL) {
     result = -ENOMEM;
     goto fail_device;
   }
+  asgn1_shrinker->count_objects = asgn1_shrink_count;
+  asgn1_shrinker->scan_objects = asgn1_shrink_scan;
+  shrinker_register(asgn1_shrinker);
+
+  if (asgn1_comp_tfm || dedup)
+    schedule_delayed_work(&asgn1_scan_work, SCAN_PERIOD);
+  for (i = 0; i < asgn1_dev_count; i++)
+    start_restore(&asgn1_devices[i]);
 
-  printk(KERN_WARNING "%s: set up udev entry\n", MYDEV_NAME);
+  printk(KERN_WARNING "%s: set up %d udev entries\n", MYDEV_NAME, asgn1_dev_count);
   return 0;
 
   /* cleanup code called when any of the initialization steps fail */
 fail_device:
+  while (i--) asgn1_cleanup_dev(&asgn1_devices[i]);
+  rcu_barrier();
+  if (disk_size) unregister_blkdev(asgn1_blk_major, MYDEV_NAME);
+fail_blkdev:
+  class_destroy(asgn1_class);
 fail_class:
-  class_destroy(asgn1_device.class);
-fail_proc:
-  /* remove the proc proc */
-  if (proc_entry) remove_proc_entry(MYPROC_NAME, NULL);
-fail_cdev:
-  /* de-register the device */
-  cdev_del(asgn1_device.cdev);
-fail_dev:
+  debugfs_remove(asgn1_debugfs);
+  kfree(asgn1_devices);
+fail_alloc:
   /* unregister device */
-  unregister_chrdev_region(asgn1_device.dev, asgn1_dev_count);
+  unregister_chrdev_region(asgn1_devices_dev, asgn1_dev_count);
+fail_dev:
+  asgn1_cleanup_pool();
+fail_pool:
+  asgn1_cleanup_compress();
+fail_compress:
+  if (asgn1_hole_page) put_page(asgn1_hole_page);
   return result;
 }
 
@@ -502,18 +4932,38 @@ fail_dev:
  * Finalise the module
  */
 void __exit asgn1_exit_module(void){
-  device_destroy(asgn1_device.class, asgn1_device.dev);
-  class_destroy(asgn1_device.class);
+  int i;
+
+  shrinker_free(asgn1_shrinker);
+  cancel_delayed_work_sync(&asgn1_scan_work);
+  /* An unfinished restore has to finish for the save to be complete */
+  for (i = 0; i < asgn1_dev_count; i++) {
+    WRITE_ONCE(asgn1_devices[i].scrub_stop, true);
+    cancel_work_sync(&asgn1_devices[i].scrub_work);
+    flush_work(&asgn1_devices[i].restore_work);
+    if (backing_file && *backing_file) save_ramdisk(&asgn1_devices[i]);
+  }
+  asgn1_cleanup_compress();
+  for (i = 0; i < asgn1_dev_count; i++)
+    asgn1_cleanup_dev(&asgn1_devices[i]);
+  if (disk_size) unregister_blkdev(asgn1_blk_major, MYDEV_NAME);
+  class_destroy(asgn1_class);
+  /* Wait for the pages still waiting out a grace period */
+  rcu_barrier();
+  asgn1_cleanup_pool();
+  if (asgn1_hole_page) put_page(asgn1_hole_page);
 
-  free_memory_pages();
-  if (proc_entry) remove_proc_entry(MYPROC_NAME, NULL);
-  /* de-register the device */
-  cdev_del(asgn1_device.cdev);
+  debugfs_remove(asgn1_debugfs);
+  kfree(asgn1_devices);
   /* unregister device */
-  unregister_chrdev_region(asgn1_device.dev, asgn1_dev_count);
+  unregister_chrdev_region(asgn1_devices_dev, asgn1_dev_count);
   printk(KERN_WARNING "%s: dismounted.\n", MYDEV_NAME);
 }
 
 
 module_init(asgn1_init_module);
 module_exit(asgn1_exit_module);
+
+#ifdef ASGN1_KUNIT_TEST
+#include "asgn1_test.c"
+#endif
@@ -0,0 +1,200 @@
+/**
+ * File: asgn1_ioctl.h
+ * Author: Andy Hansen
+ *
+ * The ioctl commands understood by the asgn1 ramdisk, shared between the
+ * module and the programs which drive it.
+ */
+
+#ifndef ASGN1_IOCTL_H
+#define ASGN1_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MYIOC_TYPE 'k'
+
+#define SET_NPROC_OP 1
+#define TEM_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int) 
+
+#define GET_CUR_PROCS_OP 2
+#define TEM_GET_CUR_PROCS _IOR(MYIOC_TYPE, GET_CUR_PROCS_OP, int)
+
+#define RESET_DEVICE_OP 3
+#define TEM_RESET_DEVICE _IO(MYIOC_TYPE, RESET_DEVICE_OP)
+
+/**
+ * A byte range of the ramdisk.
+ */
+struct asgn1_range {
+  __u64 offset;
+  __u64 length;
+};
+
+/* Frees the pages inside the range, reading them back gives zeros */
+#define PUNCH_HOLE_OP 4
+#define TEM_PUNCH_HOLE _IOW(MYIOC_TYPE, PUNCH_HOLE_OP, struct asgn1_range)
+
+/* Saves the ramdisk to its backing file, as is done on rmmod */
+#define SAVE_OP 5
+#define TEM_SAVE _IO(MYIOC_TYPE, SAVE_OP)
+
+/**
+ * A byte range of the ramdisk to preallocate, so writing to it never has
+ * to allocate memory.
+ */
+struct asgn1_reserve {
+  __u64 offset;
+  __u64 length;
+  __u32 flags;        /* ASGN1_RESERVE_* */
+  __u32 reserved;     /* must be 0 */
+};
+
+#define ASGN1_RESERVE_ZERO      0x1   /* zero pages already holding data */
+#define ASGN1_RESERVE_KEEP_SIZE 0x2   /* don't grow the ramdisk to the range */
+
+/* Preallocates the pages of the range, like fallocate() does */
+#define RESERVE_OP 6
+#define TEM_RESERVE _IOW(MYIOC_TYPE, RESERVE_OP, struct asgn1_reserve)
+
+/**
+ * Where on a NUMA machine the ramdisk puts the pages it allocates.
+ */
+struct asgn1_placement {
+  __u32 policy;       /* ASGN1_PLACE_* */
+  __s32 node;         /* node of ASGN1_PLACE_NODE, otherwise ignored */
+};
+
+#define ASGN1_PLACE_LOCAL      0   /* the node of the task writing */
+#define ASGN1_PLACE_INTERLEAVE 1   /* round robin over the nodes with memory */
+#define ASGN1_PLACE_NODE       2   /* the given node while it has memory */
+
+/* Sets the placement of pages allocated from now on */
+#define PLACEMENT_OP 7
+#define TEM_SET_PLACEMENT _IOW(MYIOC_TYPE, PLACEMENT_OP, struct asgn1_placement)
+
+/**
+ * One read or write of a batch, like a pread() or pwrite() of buf.
+ */
+struct asgn1_iovec {
+  __u32 op;           /* ASGN1_IO_* */
+  __u32 flags;        /* must be 0 */
+  __u64 offset;
+  __u64 length;
+  __u64 buf;          /* user address of the data */
+};
+
+#define ASGN1_IO_READ  0
+#define ASGN1_IO_WRITE 1
+
+/**
+ * A batch of reads and writes, carried out in order. results points to
+ * count __s64s, which get what read() or write() would have returned for
+ * each one: the bytes transferred or a negative errno.
+ */
+struct asgn1_batch {
+  __u64 iovs;         /* user address of count struct asgn1_iovec */
+  __u64 results;      /* user address of count __s64 */
+  __u32 count;        /* at most ASGN1_BATCH_MAX */
+  __u32 reserved;     /* must be 0 */
+};
+
+#define ASGN1_BATCH_MAX 1024
+
+/* Carries out the reads and writes of a batch under one lock */
+#define BATCH_OP 8
+#define TEM_BATCH _IOW(MYIOC_TYPE, BATCH_OP, struct asgn1_batch)
+
+/* Takes a snapshot of the ramdisk and returns a read-only file descriptor
+ * for it, whose contents stay as they were while the ramdisk changes */
+#define SNAPSHOT_OP 9
+#define TEM_SNAPSHOT _IO(MYIOC_TYPE, SNAPSHOT_OP)
+
+/**
+ * The progress of a scrub, which checks every page against the crc32c taken
+ * when it was last written. Needs the module loaded with checksum=1.
+ */
+#define ASGN1_SCRUB_BAD_MAX 32
+
+struct asgn1_scrub {
+  __u64 checked;      /* pages checked so far */
+  __u64 mismatches;   /* pages which didn't match their checksum */
+  __u64 bad[ASGN1_SCRUB_BAD_MAX];  /* offsets of the first mismatches */
+  __u32 running;      /* whether the scrub is still going */
+  __u32 reserved;
+};
+
+/* Starts a scrub in the background, failing with EBUSY if one is running */
+#define SCRUB_OP 10
+#define TEM_SCRUB _IO(MYIOC_TYPE, SCRUB_OP)
+
+#define SCRUB_STATUS_OP 11
+#define TEM_SCRUB_STATUS _IOR(MYIOC_TYPE, SCRUB_STATUS_OP, struct asgn1_scrub)
+
+/* Waits until the pages dropped by TEM_RESET_DEVICE or an O_TRUNC open,
+ * which are freed in the background, are all back with the system */
+#define FLUSH_FREE_OP 12
+#define TEM_FLUSH_FREE _IO(MYIOC_TYPE, FLUSH_FREE_OP)
+
+/**
+ * A key and its value, for the key-value store a ramdisk becomes with the
+ * kv module parameter set. Values are kept in the pages of the ramdisk,
+ * at offset, where a read-only mapping of it sees them without a copy
+ * until the key is put again or deleted.
+ */
+struct asgn1_kv {
+  __u64 key;          /* user address of the key */
+  __u32 key_len;      /* 1 to ASGN1_KV_KEY_MAX */
+  __u32 flags;        /* ASGN1_KV_* */
+  __u64 value;        /* user address of the value, may be 0 for a get */
+  __u64 value_len;    /* size of value, for a get set to that of the value */
+  __u64 offset;       /* set by a get to where the value is in the ramdisk */
+};
+
+#define ASGN1_KV_KEY_MAX   1024
+#define ASGN1_KV_VALUE_MAX (1ULL << 30)
+
+#define ASGN1_KV_CREATE  0x1   /* put fails with EEXIST if the key is there */
+#define ASGN1_KV_REPLACE 0x2   /* put fails with ENOENT unless it is */
+
+/* Sets the value of a key */
+#define KV_PUT_OP 13
+#define TEM_KV_PUT _IOW(MYIOC_TYPE, KV_PUT_OP, struct asgn1_kv)
+
+/* Copies as much of the value of a key as fits in value_len bytes */
+#define KV_GET_OP 14
+#define TEM_KV_GET _IOWR(MYIOC_TYPE, KV_GET_OP, struct asgn1_kv)
+
+/* Deletes a key, value is ignored */
+#define KV_DELETE_OP 15
+#define TEM_KV_DELETE _IOW(MYIOC_TYPE, KV_DELETE_OP, struct asgn1_kv)
+
+/**
+ * One key found by a scan, followed in the buffer by its key_len bytes of
+ * key, padded to a multiple of 8 bytes.
+ */
+struct asgn1_kv_rec {
+  __u64 offset;       /* where the value is in the ramdisk */
+  __u64 value_len;
+  __u32 key_len;
+  __u32 reserved;
+};
+
+/**
+ * A scan of the keys, in batches. Start with cursor 0 and pass the cursor
+ * set by each call to the next one, until count comes back 0. Keys put or
+ * deleted during a scan may or may not be seen.
+ */
+struct asgn1_kv_scan {
+  __u64 cursor;
+  __u64 buf;          /* user address of struct asgn1_kv_rec records */
+  __u32 buf_len;      /* at most ASGN1_KV_SCAN_MAX */
+  __u32 count;        /* set to the number of records in buf */
+};
+
+#define ASGN1_KV_SCAN_MAX (1 << 20)
+
+#define KV_SCAN_OP 16
+#define TEM_KV_SCAN _IOWR(MYIOC_TYPE, KV_SCAN_OP, struct asgn1_kv_scan)
+
+#endif /* ASGN1_IOCTL_H */
@@ -0,0 +1,286 @@
+/**
+ * File: asgn1_test.c
+ * Author: Andy Hansen
+ *
+ * KUnit tests of the asgn1 ramdisk at page boundaries: reads and writes
+ * which straddle, start or end on one, seeks around the last page and the
+ * holes between pages, hole punches with partial pages at either end, and
+ * faults on the last partial page, on holes and past the end. A slow case
+ * times 4 KiB reads and writes at a few device sizes. They drive
+ * /dev/asgn10 through asgn1_do_read() and asgn1_do_write(), as read() and
+ * write() do, and through asgn1_vm_fault(), so this file is included at the
+ * end of asgn1.c when the module is built with make KUNIT=1, and the suite
+ * runs on insmod. The device is emptied again afterwards, and left alone if
+ * it already holds data.
+ */
+
+#include <kunit/test.h>
+#include <linux/sizes.h>
+
+/* Reads or writes len bytes of buf at pos as read() and write() would */
+static ssize_t test_io(asgn1_dev *dev, bool write, loff_t pos, void *buf,
+    size_t len) {
+  struct kvec kv = { .iov_base = buf, .iov_len = len };
+  struct iov_iter iter;
+
+  iov_iter_kvec(&iter, write ? ITER_SOURCE : ITER_DEST, &kv, 1, len);
+  if (write) return asgn1_do_write(dev, &pos, &iter);
+  return asgn1_do_read(dev, &pos, &iter);
+}
+
+/* Fills len bytes of the device at pos with c */
+static void test_fill(struct kunit *test, loff_t pos, int c, size_t len) {
+  char *buf = kunit_kmalloc(test, len, GFP_KERNEL);
+
+  KUNIT_ASSERT_NOT_NULL(test, buf);
+  memset(buf, c, len);
+  KUNIT_ASSERT_EQ(test, test_io(test->priv, true, pos, buf, len), (ssize_t)len);
+}
+
+
+/* A write straddling a page boundary reads back whole and by halves */
+static void asgn1_test_straddle(struct kunit *test) {
+  asgn1_dev *dev = test->priv;
+  char in[100], out[100];
+  int i;
+
+  for (i = 0; i < sizeof(in); i++) in[i] = i + 1;
+  KUNIT_EXPECT_EQ(test, test_io(dev, true, PAGE_SIZE - 50, in, sizeof(in)),
+      (ssize_t)sizeof(in));
+  KUNIT_EXPECT_EQ(test, dev->data_size, (size_t)PAGE_SIZE + 50);
+
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, PAGE_SIZE - 50, out, sizeof(out)),
+      (ssize_t)sizeof(out));
+  KUNIT_EXPECT_MEMEQ(test, in, out, sizeof(in));
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, PAGE_SIZE - 1, out, 1), 1);
+  KUNIT_EXPECT_EQ(test, out[0], in[49]);
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, PAGE_SIZE, out, 1), 1);
+  KUNIT_EXPECT_EQ(test, out[0], in[50]);
+  /* The part of the first page before the write is a hole */
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, 0, out, 1), 1);
+  KUNIT_EXPECT_EQ(test, out[0], 0);
+}
+
+
+/* Reads stop at the end of the data when it is on a page boundary */
+static void asgn1_test_read_end(struct kunit *test) {
+  asgn1_dev *dev = test->priv;
+  char *out = kunit_kmalloc(test, 2 * PAGE_SIZE, GFP_KERNEL);
+
+  KUNIT_ASSERT_NOT_NULL(test, out);
+  test_fill(test, 0, 0x5a, 2 * PAGE_SIZE);
+
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, PAGE_SIZE, out, 2 * PAGE_SIZE),
+      (ssize_t)PAGE_SIZE);
+  KUNIT_EXPECT_EQ(test, out[0], 0x5a);
+  KUNIT_EXPECT_EQ(test, out[PAGE_SIZE - 1], 0x5a);
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, 2 * PAGE_SIZE, out, 1), 0);
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, 2 * PAGE_SIZE - 1, out, 2), 1);
+}
+
+
+/* SEEK_END, SEEK_DATA and SEEK_HOLE around the holes between pages */
+static void asgn1_test_seek(struct kunit *test) {
+  asgn1_dev *dev = test->priv;
+  struct file *file = kunit_kzalloc(test, sizeof(*file), GFP_KERNEL);
+  loff_t page = PAGE_SIZE;
+
+  KUNIT_ASSERT_NOT_NULL(test, file);
+  file->private_data = dev;
+  /* Pages 0 and 2 hold data, page 1 is a hole */
+  test_fill(test, 0, 1, PAGE_SIZE);
+  test_fill(test, 2 * PAGE_SIZE, 1, PAGE_SIZE);
+
+  KUNIT_EXPECT_EQ(test, asgn1_lseek(file, 0, SEEK_END), 3 * page);
+  KUNIT_EXPECT_EQ(test, asgn1_lseek(file, -page, SEEK_END), 2 * page);
+  KUNIT_EXPECT_EQ(test, asgn1_lseek(file, page, SEEK_END), 4 * page);
+  KUNIT_EXPECT_EQ(test, asgn1_lseek(file, 1, SEEK_CUR), 4 * page + 1);
+  KUNIT_EXPECT_EQ(test, asgn1_lseek(file, 3 * page, SEEK_DATA),
+      (loff_t)-ENXIO);
+
+  /* An extent would cover the hole */
+  if (extent_order) return;
+  KUNIT_EXPECT_EQ(test, asgn1_lseek(file, 0, SEEK_HOLE), page);
+  KUNIT_EXPECT_EQ(test, asgn1_lseek(file, page - 1, SEEK_DATA), page - 1);
+  KUNIT_EXPECT_EQ(test, asgn1_lseek(file, page, SEEK_DATA), 2 * page);
+  KUNIT_EXPECT_EQ(test, asgn1_lseek(file, 2 * page, SEEK_HOLE), 3 * page);
+}
+
+
+/* A punch zeroes the partial pages at its ends and frees those inside */
+static void asgn1_test_punch(struct kunit *test) {
+  asgn1_dev *dev = test->priv;
+  char out[20];
+  int i;
+
+  test_fill(test, 0, 0x33, 3 * PAGE_SIZE);
+  KUNIT_EXPECT_EQ(test, punch_hole(dev, PAGE_SIZE - 10, PAGE_SIZE + 20), 0);
+  KUNIT_EXPECT_EQ(test, dev->data_size, (size_t)3 * PAGE_SIZE);
+
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, PAGE_SIZE - 11, out, 1), 1);
+  KUNIT_EXPECT_EQ(test, out[0], 0x33);
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, PAGE_SIZE - 10, out, 20), 20);
+  for (i = 0; i < 20; i++) KUNIT_EXPECT_EQ(test, out[i], 0);
+  KUNIT_EXPECT_EQ(test, test_io(dev, false, 2 * PAGE_SIZE, out, 11), 11);
+  for (i = 0; i < 10; i++) KUNIT_EXPECT_EQ(test, out[i], 0);
+  KUNIT_EXPECT_EQ(test, out[10], 0x33);
+  /* Only single pages are freed whole, extents are zeroed */
+  if (extent_order == 0)
+    KUNIT_EXPECT_NULL(test, xa_load(dev_pages(dev), 1));
+}
+
+
+/* Faults page pgoff of a mapping of the device in, as the MM would. A
+ * page returned with VM_FAULT_LOCKED is unlocked and put by the caller */
+static vm_fault_t test_fault(struct kunit *test, unsigned long pgoff,
+    bool write, struct page **page) {
+  struct file *file = kunit_kzalloc(test, sizeof(*file), GFP_KERNEL);
+  struct vm_area_struct *vma = kunit_kzalloc(test, sizeof(*vma), GFP_KERNEL);
+  vm_fault_t result;
+
+  KUNIT_ASSERT_NOT_NULL(test, file);
+  KUNIT_ASSERT_NOT_NULL(test, vma);
+  file->private_data = test->priv;
+  vma->vm_file = file;
+  {
+    struct vm_fault vmf = {
+      .vma = vma,
+      .pgoff = pgoff,
+      .address = pgoff << PAGE_SHIFT,
+      .flags = write ? FAULT_FLAG_WRITE : 0,
+    };
+
+    result = asgn1_vm_fault(&vmf);
+    *page = vmf.page;
+  }
+  return result;
+}
+
+
+/* A fault on the last, partial page maps it whole, with zeros past the
+ * end of the data, and a read fault on a hole past it fails */
+static void asgn1_test_fault_end(struct kunit *test) {
+  struct page *page = NULL;
+  char *addr;
+  int i;
+
+  if (!mmap_fault) kunit_skip(test, "needs mmap_fault");
+  test_fill(test, 0, 0x77, PAGE_SIZE + 100);
+
+  KUNIT_ASSERT_EQ(test, test_fault(test, 1, false, &page), VM_FAULT_LOCKED);
+  addr = page_address(page);
+  for (i = 0; i < 100; i++) KUNIT_EXPECT_EQ(test, addr[i], 0x77);
+  for (; i < PAGE_SIZE; i++) KUNIT_EXPECT_EQ(test, addr[i], 0);
+  unlock_page(page);
+  put_page(page);
+
+  /* The rest of an extent holding the last page is held and maps past the
+   * end, so the first hole after the extent is tried */
+  KUNIT_EXPECT_EQ(test, test_fault(test, max(2UL, 1UL << extent_order), false,
+      &page), VM_FAULT_SIGBUS);
+}
+
+
+/* A read fault on a hole maps the hole page without filling the hole, a
+ * write fault fills it */
+static void asgn1_test_fault_hole(struct kunit *test) {
+  asgn1_dev *dev = test->priv;
+  struct page *page = NULL;
+  long pages;
+
+  if (!mmap_fault) kunit_skip(test, "needs mmap_fault");
+  /* An extent would cover the hole */
+  if (extent_order) kunit_skip(test, "needs extent_order=0");
+  test_fill(test, 0, 1, PAGE_SIZE);
+  test_fill(test, 2 * PAGE_SIZE, 1, PAGE_SIZE);
+  pages = atomic_long_read(&dev->num_pages);
+
+  KUNIT_ASSERT_EQ(test, test_fault(test, 1, false, &page), VM_FAULT_LOCKED);
+  KUNIT_EXPECT_PTR_EQ(test, page, asgn1_hole_page);
+  unlock_page(page);
+  put_page(page);
+  KUNIT_EXPECT_NULL(test, xa_load(dev_pages(dev), 1));
+  KUNIT_EXPECT_EQ(test, atomic_long_read(&dev->num_pages), pages);
+
+  KUNIT_ASSERT_EQ(test, test_fault(test, 1, true, &page), VM_FAULT_LOCKED);
+  KUNIT_EXPECT_PTR_NE(test, page, asgn1_hole_page);
+  unlock_page(page);
+  put_page(page);
+  KUNIT_EXPECT_NOT_NULL(test, xa_load(dev_pages(dev), 1));
+  KUNIT_EXPECT_EQ(test, atomic_long_read(&dev->num_pages), pages + 1);
+}
+
+
+/* Times 4 KiB writes filling the device to a few sizes, then 4 KiB reads
+ * of all of it, and reports the mean of each */
+static void asgn1_test_bench(struct kunit *test) {
+  static const size_t sizes[] = { SZ_1M, SZ_16M, SZ_64M };
+  asgn1_dev *dev = test->priv;
+  char *buf = kunit_kzalloc(test, SZ_4K, GFP_KERNEL);
+  size_t nr;
+  loff_t pos;
+  u64 start, write_ns, read_ns;
+  int i;
+
+  KUNIT_ASSERT_NOT_NULL(test, buf);
+  for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+    if (dev->max_bytes && sizes[i] > dev->max_bytes) break;
+    nr = sizes[i] / SZ_4K;
+
+    start = ktime_get_ns();
+    for (pos = 0; pos < sizes[i]; pos += SZ_4K)
+      if (test_io(dev, true, pos, buf, SZ_4K) != SZ_4K) break;
+    write_ns = ktime_get_ns() - start;
+    KUNIT_ASSERT_EQ(test, pos, (loff_t)sizes[i]);
+
+    start = ktime_get_ns();
+    for (pos = 0; pos < sizes[i]; pos += SZ_4K)
+      if (test_io(dev, false, pos, buf, SZ_4K) != SZ_4K) break;
+    read_ns = ktime_get_ns() - start;
+    KUNIT_ASSERT_EQ(test, pos, (loff_t)sizes[i]);
+
+    kunit_info(test, "%zu KiB: write %llu ns, read %llu ns per 4 KiB\n",
+        sizes[i] / SZ_1K, div_u64(write_ns, nr), div_u64(read_ns, nr));
+    drop_all_pages(dev, false);
+    flush_work(&dev->free_work);
+  }
+}
+
+
+static int asgn1_test_init(struct kunit *test) {
+  asgn1_dev *dev = &asgn1_devices[0];
+
+  if (kv || dev->data_size || READ_ONCE(dev->restoring) ||
+      atomic_read(&dev->nprocs))
+    kunit_skip(test, "%s0 is in use", MYDEV_NAME);
+  test->priv = dev;
+  return 0;
+}
+
+static void asgn1_test_exit(struct kunit *test) {
+  asgn1_dev *dev = test->priv;
+
+  if (dev == NULL) return;
+  drop_all_pages(dev, false);
+  flush_work(&dev->free_work);
+}
+
+static struct kunit_case asgn1_test_cases[] = {
+  KUNIT_CASE(asgn1_test_straddle),
+  KUNIT_CASE(asgn1_test_read_end),
+  KUNIT_CASE(asgn1_test_seek),
+  KUNIT_CASE(asgn1_test_punch),
+  KUNIT_CASE(asgn1_test_fault_end),
+  KUNIT_CASE(asgn1_test_fault_hole),
+  KUNIT_CASE_SLOW(asgn1_test_bench),
+  {}
+};
+
+static struct kunit_suite asgn1_test_suite = {
+  .name = "asgn1",
+  .init = asgn1_test_init,
+  .exit = asgn1_test_exit,
+  .test_cases = asgn1_test_cases,
+};
+
+kunit_test_suite(asgn1_test_suite);
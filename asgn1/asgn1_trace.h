@@ -0,0 +1,135 @@
+/**
+ * File: asgn1_trace.h
+ * Author: Andy Hansen
+ *
+ * Tracepoints of the asgn1 ramdisk, found under events/asgn1 in tracefs.
+ * Every operation records the byte range it was given, the pages it
+ * touched, its result and how long it took in ns, so perf script or
+ * bpftrace can break latencies down without rebuilding the module.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM asgn1
+
+#if !defined(ASGN1_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define ASGN1_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(asgn1_op,
+  TP_PROTO(dev_t dev, loff_t offset, size_t length, unsigned long pages,
+    long result, u64 duration),
+  TP_ARGS(dev, offset, length, pages, result, duration),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(loff_t, offset)
+    __field(size_t, length)
+    __field(unsigned long, pages)
+    __field(long, result)
+    __field(u64, duration)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->offset = offset;
+    __entry->length = length;
+    __entry->pages = pages;
+    __entry->result = result;
+    __entry->duration = duration;
+  ),
+
+  TP_printk("dev %d:%d offset %lld length %zu pages %lu result %ld duration %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->offset,
+    __entry->length, __entry->pages, __entry->result, __entry->duration)
+);
+
+/* open() and close(), at the file position they start and end with */
+DEFINE_EVENT(asgn1_op, asgn1_open,
+  TP_PROTO(dev_t dev, loff_t offset, size_t length, unsigned long pages,
+    long result, u64 duration),
+  TP_ARGS(dev, offset, length, pages, result, duration));
+
+DEFINE_EVENT(asgn1_op, asgn1_release,
+  TP_PROTO(dev_t dev, loff_t offset, size_t length, unsigned long pages,
+    long result, u64 duration),
+  TP_ARGS(dev, offset, length, pages, result, duration));
+
+/* Reads and writes of every kind: read(), splice, batches and the disk */
+DEFINE_EVENT(asgn1_op, asgn1_read,
+  TP_PROTO(dev_t dev, loff_t offset, size_t length, unsigned long pages,
+    long result, u64 duration),
+  TP_ARGS(dev, offset, length, pages, result, duration));
+
+DEFINE_EVENT(asgn1_op, asgn1_write,
+  TP_PROTO(dev_t dev, loff_t offset, size_t length, unsigned long pages,
+    long result, u64 duration),
+  TP_ARGS(dev, offset, length, pages, result, duration));
+
+/* The offset asked for, the result is the new position */
+DEFINE_EVENT(asgn1_op, asgn1_lseek,
+  TP_PROTO(dev_t dev, loff_t offset, size_t length, unsigned long pages,
+    long result, u64 duration),
+  TP_ARGS(dev, offset, length, pages, result, duration));
+
+/* The pages are those remapped up front, none with mmap_fault */
+DEFINE_EVENT(asgn1_op, asgn1_mmap,
+  TP_PROTO(dev_t dev, loff_t offset, size_t length, unsigned long pages,
+    long result, u64 duration),
+  TP_ARGS(dev, offset, length, pages, result, duration));
+
+/* Dropping every page, by TEM_RESET_DEVICE or by an O_TRUNC open */
+DEFINE_EVENT(asgn1_op, asgn1_reset,
+  TP_PROTO(dev_t dev, loff_t offset, size_t length, unsigned long pages,
+    long result, u64 duration),
+  TP_ARGS(dev, offset, length, pages, result, duration));
+
+DEFINE_EVENT(asgn1_op, asgn1_truncate,
+  TP_PROTO(dev_t dev, loff_t offset, size_t length, unsigned long pages,
+    long result, u64 duration),
+  TP_ARGS(dev, offset, length, pages, result, duration));
+
+/**
+ * A page or extent allocated to hold data, with the node it went to and
+ * whether it came from the per CPU pool.
+ */
+TRACE_EVENT(asgn1_page_alloc,
+  TP_PROTO(dev_t dev, unsigned long index, unsigned int order, int node,
+    bool pooled, long result, u64 duration),
+  TP_ARGS(dev, index, order, node, pooled, result, duration),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, index)
+    __field(unsigned int, order)
+    __field(int, node)
+    __field(bool, pooled)
+    __field(long, result)
+    __field(u64, duration)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->index = index;
+    __entry->order = order;
+    __entry->node = node;
+    __entry->pooled = pooled;
+    __entry->result = result;
+    __entry->duration = duration;
+  ),
+
+  TP_printk("dev %d:%d offset %lld length %lu pages %lu node %d pooled %d result %ld duration %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev),
+    (long long)__entry->index << PAGE_SHIFT, PAGE_SIZE << __entry->order,
+    1UL << __entry->order, __entry->node, __entry->pooled, __entry->result,
+    __entry->duration)
+);
+
+#endif /* ASGN1_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE asgn1_trace
+#include <trace/define_trace.h>
@@ -20,6 +20,9 @@
 #define RESET_DEVICE_OP 3
 #define ASGN1_RESET_DEVICE _IO(MYIOC_TYPE, RESET_DEVICE_OP)
 
+#define SNAPSHOT_OP 9
+#define ASGN1_SNAPSHOT _IO(MYIOC_TYPE, SNAPSHOT_OP)
+
 
 
 ssize_t my_fread(int fildes, void *buf, size_t nbyte) {
@@ -87,11 +90,124 @@ void read_and_compare (int fd, char *read_buf, char *mmap_buf,
 
 #define SIZE 1024 * 64
 
+
+/* Fails the test with what went wrong at which step */
+void check (int ok, const char *what)
+{
+    if (!ok) {
+        fprintf (stderr, "%s failed:  %s\n", what, strerror (errno));
+        exit (1);
+    }
+}
+
+
+/*
+ * Checks reads, writes, seeks and mappings which start, end or straddle a
+ * page boundary, against buf, which holds what the device holds.
+ */
+void check_boundaries (int fd, char *buf, long len)
+{
+    long page = sysconf (_SC_PAGESIZE);
+    char *tmp, *map;
+    int i;
+
+    tmp = malloc (2 * page);
+    check (tmp != NULL, "malloc");
+
+    /* A write straddling a page boundary reads back whole, and so do its
+     * two halves on their own */
+    for (i = 0; i < 100; i++)
+        buf[page - 50 + i] = random () % 256;
+    check (pwrite (fd, buf + page - 50, 100, page - 50) == 100,
+           "write across a page boundary");
+    check (pread (fd, tmp, 100, page - 50) == 100 &&
+           memcmp (tmp, buf + page - 50, 100) == 0,
+           "read across a page boundary");
+    check (pread (fd, tmp, 1, page - 1) == 1 && tmp[0] == buf[page - 1],
+           "read of the last byte of a page");
+    check (pread (fd, tmp, 1, page) == 1 && tmp[0] == buf[page],
+           "read of the first byte of a page");
+
+    /* Reads stop at the end of the data, which is on a page boundary */
+    check (pread (fd, tmp, 2 * page, len - page) == page &&
+           memcmp (tmp, buf + len - page, page) == 0,
+           "read past the end");
+    check (pread (fd, tmp, 1, len) == 0, "read at the end");
+
+    /* SEEK_END is relative to the end of the data */
+    check (lseek (fd, 0, SEEK_END) == len, "seek to the end");
+    check (lseek (fd, page, SEEK_END) == len + page, "seek past the end");
+    check (lseek (fd, -page, SEEK_END) == len - page, "seek back from the end");
+    check (lseek (fd, 1, SEEK_CUR) == len - page + 1, "seek forward");
+    check (my_fread (fd, tmp, page) == page - 1 &&
+           memcmp (tmp, buf + len - page + 1, page - 1) == 0,
+           "read after seeking into the last page");
+
+    /* A mapping at a page offset sees the pages from there on, and stores
+     * through it are seen by read() */
+    map = mmap (NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page);
+    check (map != MAP_FAILED, "mmap at a page offset");
+    check (memcmp (map, buf + page, 2 * page) == 0,
+           "comparison of a mapping at a page offset");
+    map[page] = buf[2 * page] ^ 0xff;
+    buf[2 * page] = map[page];
+    check (pread (fd, tmp, 1, 2 * page) == 1 && tmp[0] == buf[2 * page],
+           "read of a store through a mapping at a page offset");
+    check (munmap (map, 2 * page) == 0, "munmap");
+
+    free (tmp);
+    (void)lseek (fd, 0, SEEK_SET);
+}
+
+/*
+ * Checks that a snapshot keeps seeing a hole where a page was written after
+ * it was taken, even once a later snapshot has kept that page. fd must be
+ * of an empty device which nothing maps.
+ */
+void check_snapshots (int fd)
+{
+    long page = sysconf (_SC_PAGESIZE);
+    char *tmp, *zero;
+    int first, second;
+
+    tmp = malloc (page);
+    zero = calloc (1, page);
+    check (tmp != NULL && zero != NULL, "malloc");
+
+    /* Page 1 is a hole when the first snapshot is taken */
+    memset (tmp, 'a', page);
+    check (pwrite (fd, tmp, page, 0) == page &&
+           pwrite (fd, tmp, page, 2 * page) == page, "write around a hole");
+    first = ioctl (fd, ASGN1_SNAPSHOT);
+    check (first >= 0, "first snapshot");
+
+    memset (tmp, 'b', page);
+    check (pwrite (fd, tmp, page, page) == page, "write into the hole");
+    second = ioctl (fd, ASGN1_SNAPSHOT);
+    check (second >= 0, "second snapshot");
+    memset (tmp, 'c', page);
+    check (pwrite (fd, tmp, page, page) == page, "write over the page");
+
+    check (pread (first, tmp, page, page) == page &&
+           memcmp (tmp, zero, page) == 0, "read of the hole in the first snapshot");
+    memset (zero, 'b', page);
+    check (pread (second, tmp, page, page) == page &&
+           memcmp (tmp, zero, page) == 0, "read of the page in the second snapshot");
+    memset (zero, 'c', page);
+    check (pread (fd, tmp, page, page) == page &&
+           memcmp (tmp, zero, page) == 0, "read of the page in the device");
+
+    close (second);
+    close (first);
+    free (zero);
+    free (tmp);
+}
+
 int main (int argc, char **argv)
 {
     unsigned long i, j;
     int fd;
-    char *buf, *read_buf, *mmap_buf, *filename = "/dev/asgn1";
+    char *buf, *read_buf, *mmap_buf, *filename = "/dev/asgn10";
     int nproc = 12345;
     long proc_count;
 
@@ -152,6 +268,11 @@ int main (int argc, char **argv)
     read_and_compare (fd, read_buf, mmap_buf, SIZE);
     printf ("comparison of modified data via read() and mmap() successful\n");
 
+    /* buf has to follow the byte changed through the mapping */
+    buf[j] = mmap_buf[j];
+    check_boundaries (fd, buf, SIZE);
+    printf ("reads, writes, seeks and mappings across page boundaries successful\n");
+
 
     (void)lseek (fd, 0, SEEK_SET);
 
@@ -173,5 +294,15 @@ int main (int argc, char **argv)
     }
     fprintf(stderr, "all pages freed\n");
 
+    /* Snapshots can't be taken while the device is remapped */
+    check (munmap (mmap_buf, SIZE) == 0, "munmap");
+    check_snapshots (fd);
+    printf ("snapshots keep seeing holes written after them\n");
+
+    if (ioctl (fd, ASGN1_RESET_DEVICE) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+
     return 0;
 }
@@ -0,0 +1,383 @@
+/**
+ * File: rw_bench.c
+ * Author: Andy Hansen
+ *
+ * Benchmarks an asgn1 ramdisk. For every ramdisk size, block size, kind of
+ * operation, access pattern and access method asked for, the device is
+ * driven by 1, 2, 4 ... max workers at once for a fixed time, each worker
+ * opening the device itself. One CSV line is printed per run, giving the
+ * throughput, IOPS and latency percentiles of the operations done.
+ *
+ *   op      read or write
+ *   access  seq (each worker walks its own slice of the ramdisk in order)
+ *           or rand (blocks picked at random over the whole ramdisk)
+ *   method  syscall (read() or write() for seq, pread() or pwrite() for
+ *           rand) or mmap (memcpy to or from a shared mapping)
+ *
+ * Workers are threads, or processes with -P. The ramdisk is refilled with
+ * the same pattern before each size, and the random offsets come from
+ * fixed seeds, so runs can be compared across driver changes.
+ *
+ * Usage: rw_bench [-d device] [-s MiB,...] [-b block size,...]
+ *                 [-o read,write] [-a seq,rand] [-m syscall,mmap]
+ *                 [-t max workers] [-n seconds per run] [-P]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "asgn1_ioctl.h"
+
+#define MAX_LIST 16
+
+/* Latencies are kept in buckets of 1/16 of a power of two of ns */
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define LAT_BUCKETS (64 * SUB_BUCKETS)
+
+enum { OP_READ, OP_WRITE };
+enum { ACCESS_SEQ, ACCESS_RAND };
+enum { METHOD_SYSCALL, METHOD_MMAP };
+
+static const char *op_names[] = { "read", "write" };
+static const char *access_names[] = { "seq", "rand" };
+static const char *method_names[] = { "syscall", "mmap" };
+
+static char *filename = "/dev/asgn10";
+static size_t sizes[MAX_LIST] = { 64 };         /* MiB */
+static int nsizes = 1;
+static size_t blocks[MAX_LIST] = { 4096 };
+static int nblocks_list = 1;
+static int ops[2] = { OP_READ, OP_WRITE };
+static int nops = 2;
+static int accesses[2] = { ACCESS_SEQ, ACCESS_RAND };
+static int naccesses = 2;
+static int methods[2] = { METHOD_SYSCALL, METHOD_MMAP };
+static int nmethods = 2;
+static int max_workers = 8;
+static int seconds = 3;
+static int use_procs;
+
+/**
+ * What one run asks of every worker.
+ */
+struct run {
+  size_t dev_size;
+  size_t block_size;
+  int op;
+  int access;
+  int method;
+  int nworkers;
+};
+
+/**
+ * One worker and what it measured. Workers live in shared memory so that
+ * worker processes can report back.
+ */
+struct worker {
+  pthread_t thread;
+  int id;
+  unsigned long ops;
+  unsigned long lat[LAT_BUCKETS];
+};
+
+static struct run cur;
+static volatile int *running;       /* in shared memory as well */
+
+
+static unsigned int lat_bucket(unsigned long ns) {
+  int msb;
+
+  if (ns < SUB_BUCKETS) return ns;
+  msb = 63 - __builtin_clzl(ns);
+  return (msb - SUB_BITS + 1) * SUB_BUCKETS +
+      ((ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+
+/* The smallest latency falling in bucket b */
+static unsigned long bucket_ns(unsigned int b) {
+  int msb;
+
+  if (b < SUB_BUCKETS) return b;
+  msb = b / SUB_BUCKETS + SUB_BITS - 1;
+  return (unsigned long)(SUB_BUCKETS | (b % SUB_BUCKETS)) << (msb - SUB_BITS);
+}
+
+
+static unsigned long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+static void die(const char *what) {
+  fprintf(stderr, "%s failed:  %s\n", what, strerror(errno));
+  exit(1);
+}
+
+
+static void *worker_main(void *arg) {
+  struct worker *w = arg;
+  size_t nblocks = cur.dev_size / cur.block_size;
+  size_t slice = nblocks / cur.nworkers;
+  size_t block = slice * w->id;     /* next block of a sequential walk */
+  unsigned int seed = w->id + 1;
+  unsigned long start;
+  char *buf, *map = NULL;
+  off_t off;
+  ssize_t n;
+  int fd;
+
+  if ((fd = open(filename, O_RDWR)) < 0) die("open");
+  if ((buf = malloc(cur.block_size)) == NULL) exit(1);
+  memset(buf, 0x5a, cur.block_size);
+  if (cur.method == METHOD_MMAP) {
+    map = mmap(NULL, cur.dev_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) die("mmap");
+  }
+  if (slice == 0) slice = 1;
+  if (lseek(fd, (off_t)block * cur.block_size, SEEK_SET) < 0) die("lseek");
+
+  while (*running) {
+    if (cur.access == ACCESS_RAND) {
+      off = (off_t)(rand_r(&seed) % nblocks) * cur.block_size;
+    } else {
+      off = (off_t)block * cur.block_size;
+      /* Wrap round within the slice of this worker */
+      if (++block % slice == 0 || block >= nblocks) {
+        block = slice * w->id;
+        if (cur.method == METHOD_SYSCALL &&
+            lseek(fd, (off_t)block * cur.block_size, SEEK_SET) < 0)
+          die("lseek");
+      }
+    }
+
+    start = now_ns();
+    if (cur.method == METHOD_MMAP) {
+      if (cur.op == OP_READ) memcpy(buf, map + off, cur.block_size);
+      else memcpy(map + off, buf, cur.block_size);
+      n = cur.block_size;
+    } else if (cur.access == ACCESS_RAND) {
+      if (cur.op == OP_READ) n = pread(fd, buf, cur.block_size, off);
+      else n = pwrite(fd, buf, cur.block_size, off);
+    } else {
+      if (cur.op == OP_READ) n = read(fd, buf, cur.block_size);
+      else n = write(fd, buf, cur.block_size);
+    }
+    w->lat[lat_bucket(now_ns() - start)]++;
+    if (n != (ssize_t)cur.block_size) die(op_names[cur.op]);
+    w->ops++;
+  }
+
+  if (map) munmap(map, cur.dev_size);
+  free(buf);
+  close(fd);
+  return NULL;
+}
+
+
+/**
+ * Returns the latency in ns below which the fraction p of the operations
+ * counted in lat fall.
+ */
+static unsigned long percentile(const unsigned long *lat, unsigned long total,
+    double p) {
+  unsigned long target = (unsigned long)(p * total + 0.5);
+  unsigned long seen = 0;
+  unsigned int b;
+
+  if (target == 0) target = 1;
+  for (b = 0; b < LAT_BUCKETS; b++) {
+    seen += lat[b];
+    if (seen >= target) return bucket_ns(b);
+  }
+  return 0;
+}
+
+
+/**
+ * Runs cur.nworkers workers for the configured time and prints the CSV
+ * line of the run.
+ */
+static void run(void) {
+  struct worker *workers;
+  unsigned long lat[LAT_BUCKETS] = { 0 };
+  unsigned long ops = 0;
+  unsigned long start, elapsed;
+  size_t shared = sizeof(*workers) * cur.nworkers;
+  pid_t pid;
+  int i, b;
+
+  workers = mmap(NULL, shared, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (workers == MAP_FAILED) die("mmap");
+  for (i = 0; i < cur.nworkers; i++) workers[i].id = i;
+
+  *running = 1;
+  start = now_ns();
+  for (i = 0; i < cur.nworkers; i++) {
+    if (!use_procs) {
+      pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+      continue;
+    }
+    if ((pid = fork()) < 0) die("fork");
+    if (pid == 0) {
+      worker_main(&workers[i]);
+      _exit(0);
+    }
+  }
+  sleep(seconds);
+  *running = 0;
+  for (i = 0; i < cur.nworkers; i++) {
+    if (!use_procs) pthread_join(workers[i].thread, NULL);
+    else if (wait(NULL) < 0) die("wait");
+  }
+  elapsed = now_ns() - start;
+
+  for (i = 0; i < cur.nworkers; i++) {
+    ops += workers[i].ops;
+    for (b = 0; b < LAT_BUCKETS; b++) lat[b] += workers[i].lat[b];
+  }
+  munmap(workers, shared);
+
+  printf("%s,%s,%s,%s,%d,%zu,%zu,%.1f,%.0f,%lu,%lu,%lu\n",
+      op_names[cur.op], access_names[cur.access], method_names[cur.method],
+      use_procs ? "procs" : "threads", cur.nworkers, cur.dev_size >> 20,
+      cur.block_size, (double)ops * cur.block_size * 1e3 / elapsed,
+      (double)ops * 1e9 / elapsed, percentile(lat, ops, 0.50),
+      percentile(lat, ops, 0.99), percentile(lat, ops, 0.999));
+  fflush(stdout);
+}
+
+
+/**
+ * Empties the ramdisk and writes dev_size bytes of a fixed pattern to it,
+ * so every run reads real pages and the results are repeatable.
+ */
+static void fill(int fd, size_t dev_size) {
+  size_t done, chunk;
+  char *buf;
+
+  if (ioctl(fd, TEM_RESET_DEVICE) < 0) die("ioctl");
+  if (lseek(fd, 0, SEEK_SET) < 0) die("lseek");
+  if ((buf = malloc(1 << 20)) == NULL) exit(1);
+  memset(buf, 0xa5, 1 << 20);
+  for (done = 0; done < dev_size; done += chunk) {
+    chunk = dev_size - done < 1 << 20 ? dev_size - done : 1 << 20;
+    if (write(fd, buf, chunk) != (ssize_t)chunk) die("write");
+  }
+  free(buf);
+}
+
+
+/**
+ * Parses a comma separated list of numbers into list, returning how many
+ * there were.
+ */
+static int parse_numbers(char *arg, size_t *list) {
+  char *tok;
+  int n = 0;
+
+  for (tok = strtok(arg, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+    list[n++] = strtoul(tok, NULL, 0);
+  return n;
+}
+
+
+/**
+ * Parses a comma separated list of the names in names into list, returning
+ * how many there were.
+ */
+static int parse_names(char *arg, const char **names, int nnames, int *list) {
+  char *tok;
+  int n = 0, i;
+
+  for (tok = strtok(arg, ","); tok && n < nnames; tok = strtok(NULL, ",")) {
+    for (i = 0; i < nnames && strcmp(tok, names[i]); i++);
+    if (i == nnames) {
+      fprintf(stderr, "unknown %s\n", tok);
+      exit(1);
+    }
+    list[n++] = i;
+  }
+  return n;
+}
+
+
+int main(int argc, char **argv) {
+  int opt, fd, nprocs, s, b, o, a, m;
+
+  while ((opt = getopt(argc, argv, "d:s:b:o:a:m:t:n:P")) != -1) {
+    switch (opt) {
+      case 'd': filename = optarg; break;
+      case 's': nsizes = parse_numbers(optarg, sizes); break;
+      case 'b': nblocks_list = parse_numbers(optarg, blocks); break;
+      case 'o': nops = parse_names(optarg, op_names, 2, ops); break;
+      case 'a': naccesses = parse_names(optarg, access_names, 2, accesses); break;
+      case 'm': nmethods = parse_names(optarg, method_names, 2, methods); break;
+      case 't': max_workers = atoi(optarg); break;
+      case 'n': seconds = atoi(optarg); break;
+      case 'P': use_procs = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-d device] [-s MiB,...] [-b block,...] "
+            "[-o read,write] [-a seq,rand] [-m syscall,mmap] "
+            "[-t workers] [-n seconds] [-P]\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (max_workers < 1 || seconds < 1 || !nsizes || !nblocks_list || !nops ||
+      !naccesses || !nmethods) {
+    fprintf(stderr, "bad arguments\n");
+    exit(1);
+  }
+  for (b = 0; b < nblocks_list; b++) {
+    for (s = 0; s < nsizes; s++) {
+      if (blocks[b] == 0 || (sizes[s] << 20) < blocks[b]) {
+        fprintf(stderr, "bad sizes\n");
+        exit(1);
+      }
+    }
+  }
+
+  running = mmap(NULL, sizeof(*running), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (running == MAP_FAILED) die("mmap");
+
+  if ((fd = open(filename, O_RDWR)) < 0) die("open");
+  /* Every worker opens the device on its own, so let enough of them in */
+  nprocs = max_workers + 1;
+  if (ioctl(fd, TEM_SET_NPROC, &nprocs) < 0) die("ioctl");
+
+  printf("op,access,method,kind,workers,size_mib,block,MB/s,IOPS,"
+      "p50_ns,p99_ns,p999_ns\n");
+  for (s = 0; s < nsizes; s++) {
+    cur.dev_size = sizes[s] << 20;
+    fill(fd, cur.dev_size);
+    for (b = 0; b < nblocks_list; b++)
+      for (o = 0; o < nops; o++)
+        for (a = 0; a < naccesses; a++)
+          for (m = 0; m < nmethods; m++)
+            for (cur.nworkers = 1; cur.nworkers <= max_workers;
+                cur.nworkers *= 2) {
+              cur.block_size = blocks[b];
+              cur.op = ops[o];
+              cur.access = accesses[a];
+              cur.method = methods[m];
+              run();
+            }
+  }
+
+  close(fd);
+  return 0;
+}